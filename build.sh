@@ -15,3 +15,8 @@ if [ "$1" = "run" ]; then
     export LD_LIBRARY_PATH=./steam:$LD_LIBRARY_PATH
     ./$exe
 fi
+
+if [ "$1" = "bench" ]; then
+    export LD_LIBRARY_PATH=./steam:$LD_LIBRARY_PATH
+    ./$exe --bench-network
+fi
@@ -1,8 +1,46 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <deque>
+#include <functional>
 #include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HAS_SSE2 1
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include <steam_api.h>
 
 #include <raylib.h>
@@ -13,6 +51,128 @@
 #define APP_ID 480
 #define MAX_CHATMSG_SIZE 1024 * 4
 
+// Connection diagnostics: one sample per peer per second, three minutes kept
+#define DIAG_POLL_INTERVAL 1.0
+#define DIAG_HISTORY_SIZE 180
+#define DIAG_MAX_LANES 4
+// Probe connections the panel opens to other members, see Diagnostics
+#define DIAG_VIRTUAL_PORT 7
+#define DIAG_MAX_PEERS 16
+
+// Tracing: events per thread before we start dropping, and where F9 / exit dumps them
+#define TRACE_BUFFER_EVENTS 1024 * 256
+#define TRACE_OUTPUT_PATH "trace.json"
+
+// Callback recordings (--record / --replay)
+#define RECORDING_MAGIC "CRCB"
+#define RECORDING_VERSION 1
+
+// Network impairment benchmark (--bench-network), per profile
+#define BENCH_MESSAGES 1000
+#define BENCH_MESSAGES_PER_SEC 200
+#define BENCH_TIMEOUT 30.0
+
+// Metrics: counters are split across shards so threads don't fight over one cache line.
+// Histograms are log-linear, 8 sub-buckets per power of two, up to 2^40, plus one
+// overflow bucket past that
+#define METRICS_SHARDS 8
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS (((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + 1)
+#define METRICS_DEFAULT_INTERVAL 10.0
+// The HTTP endpoint's wait after accept fails for lack of descriptors or memory
+#define METRICS_ACCEPT_BACKOFF_MS 100
+
+// Text rendering: glyphs are rasterized as SDF at FONT_BASE_SIZE and scaled from there
+#define FONT_PATH "resources/font.ttf"
+#define FONT_BASE_SIZE 32
+#define FONT_ATLAS_WIDTH 1024
+#define FONT_ATLAS_MAX_HEIGHT 4096
+
+// Shaped runs are cached up to this many bytes, least recently drawn go first
+#define SHAPING_CACHE_BUDGET 1024 * 1024 * 4
+
+// Avatars: one AVATAR_SIZE cell per member in a single texture, 256 cells. When they
+// run out, the least recently used cell goes, if it's been unused this many seconds
+#define AVATAR_SIZE 32
+#define AVATAR_ATLAS_SIZE 512
+#define AVATAR_EVICT_AFTER 10.0
+
+// Rich text parser benchmark (--bench-parse)
+#define BENCH_PARSE_MESSAGES 10000
+#define BENCH_PARSE_ROUNDS 50
+
+// Chat history: every TIME_INDEX_STRIDE-th timestamp goes into the sparse time index
+#define TIME_INDEX_STRIDE 64
+#define WATERMARKS_PATH "read_watermarks.txt"
+#define WATERMARKS_SAVE_INTERVAL 5.0
+
+// Chat input: lines shown before the box starts scrolling, undo steps kept
+#define CHAT_INPUT_MAX_VISIBLE_LINES 6
+#define CHAT_INPUT_UNDO_LIMIT 200
+#define CHAT_INPUT_MAX_DRAWN_BYTES 512
+
+// Messages over one lobby chat entry go out in parts, each starting with a
+// MULTIPART_HEADER_SIZE byte header: magic, u32 message id, u16 part, u16 part count
+#define MULTIPART_MAGIC "\x01MP"
+#define MULTIPART_HEADER_SIZE 11
+#define MULTIPART_MAX_PARTS 256
+#define MULTIPART_MAX_PENDING_BYTES 1024 * 1024 * 4
+#define MULTIPART_TIMEOUT 30.0
+// Longest text drawn for a single message row, the rest stays in the history
+#define MESSAGE_PREVIEW_BYTES 512
+// Same sender messages, or joins and leaves, closer together than this share a group
+#define MESSAGE_GROUP_WINDOW_MS 5 * 60 * 1000
+// Longest "[name]: " prefix looked for, Steam names are at most 32 characters
+#define MESSAGE_PREFIX_MAX_BYTES 160
+
+// Lobby browser. Every Spacewar sample shares app id 480, so lobbies are tagged
+// with the app and protocol version and the list is filtered on both
+#define LOBBY_APP_TAG "chatroom"
+#define LOBBY_PROTOCOL_VERSION 1
+#define LOBBY_BROWSER_MAX_RESULTS 200
+#define LOBBY_BROWSER_REFRESH_INTERVAL 15.0
+// Lobbies are ranked by estimated ping in LOBBY_PING_BUCKET_MS steps, most members
+// first within a step. Local ping data older than LOBBY_PING_MAX_AGE gets re-measured
+#define LOBBY_PING_BUCKET_MS 20
+#define LOBBY_PING_MAX_AGE 300.0f
+#define LOBBY_PING_CHECK_INTERVAL 5.0
+
+// Rooms past one lobby's member cap spread over linked shard lobbies. Whoever
+// owns the newest shard opens the next one once it reaches SHARD_SPAWN_MEMBERS
+#define LOBBY_MAX_MEMBERS 100
+#define SHARD_SPAWN_MEMBERS 90
+#define SHARD_CHECK_INTERVAL 2.0
+// Bridges forward chat entries between shards wrapped in a RELAY_HEADER_SIZE byte
+// header: magic, u64 origin lobby, u32 origin chat entry id, u64 original sender
+#define RELAY_MAGIC "\x01RL"
+#define RELAY_HEADER_SIZE 23
+#define RELAY_SEEN_LIMIT 4096
+// What a sender may put in one entry, so a bridge can still wrap it
+#define CHAT_ENTRY_BUDGET (MAX_CHATMSG_SIZE - RELAY_HEADER_SIZE)
+
+// Owners publish the first ROSTER_MAX_MEMBERS member ids as "roster" lobby data, at most
+// every ROSTER_PUBLISH_INTERVAL, so clients can look them up before they join
+#define ROSTER_MAX_MEMBERS 64
+#define ROSTER_PUBLISH_INTERVAL 5.0
+// Hovered lobbies and invites are requested again after PREFETCH_INTERVAL at most,
+// with avatars for the first PREFETCH_AVATARS roster entries, about one panel
+#define PREFETCH_INTERVAL 10.0
+#define PREFETCH_AVATARS 24
+// Join stages waiting on other clients (personas, avatars) give up after this many seconds
+#define JOIN_STAGE_TIMEOUT 5.0
+
+// Warm start. The last session is written on exit and restored before Steam is up
+#define SNAPSHOT_PATH "session.snapshot"
+#define SNAPSHOT_MAGIC "CRSS"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_MESSAGES 200
+
+// Typing and idle state, shared as "presence" lobby member data
+#define PRESENCE_DEFAULT_INTERVAL 2.0 // least seconds between writes, --presence-interval
+#define PRESENCE_TYPING_TIMEOUT 5.0   // typing ends this long after the last edit
+#define PRESENCE_IDLE_AFTER 120.0     // without keyboard or mouse input
+
 #define LOG( x ) std::cout << ( x ) << std::endl;
 #define MIN( x, y ) ((x) < (y) ? (x) : (y))
 
@@ -21,7 +181,8 @@ enum eScreenState {
     OUTSIDE_LOBBY,
     LOBBY_CREATION,
     LOBBY_JOIN,
-    LOBBY
+    LOBBY,
+    LOBBY_BROWSER
 } screen_state;
 
 static struct {
@@ -29,6 +190,196 @@ static struct {
     std::string loading_screen_text;
 } program;
 
+enum eSpanStyle : uint8 {
+    SPAN_PLAIN   = 0,
+    SPAN_BOLD    = 1 << 0,
+    SPAN_ITALIC  = 1 << 1,
+    SPAN_STRIKE  = 1 << 2,
+    SPAN_CODE    = 1 << 3,
+    SPAN_MENTION = 1 << 4,
+    SPAN_LINK    = 1 << 5,
+};
+
+// Visible byte range of a message and how to draw it. Markup delimiters fall between spans
+// Offsets are 32 bit since reassembled messages can run to megabytes
+struct TextSpan {
+    uint32 begin;
+    uint32 end;
+    uint8 style;
+};
+
+struct ChatMessage {
+    std::string text;
+    std::vector<TextSpan> spans; // parsed once when the message arrives
+    int64 timestamp;             // unix ms when received, never decreasing within a history
+    uint32 row;                  // index of the MessageRow that draws it
+    uint16 body;                 // offset past the "[name]: " prefix, 0 if there is none
+};
+
+enum eRowKind : uint8 {
+    ROW_MESSAGE = 0,  // one message, with its sender prefix
+    ROW_CONTINUED,    // one message from the sender of the row above, prefix hidden
+    ROW_MEMBERSHIP    // a run of join and leave notices, drawn as one summary line
+};
+
+// What the message list actually draws. Built as messages arrive, so
+// scrolling and jumps work in rows while the history stays per message
+struct MessageRow {
+    uint32 index; // into messages, or into membership_runs for ROW_MEMBERSHIP
+    eRowKind kind;
+};
+
+// Join and leave notices are only counted, they never become ChatMessages,
+// so a lobby with heavy churn costs one of these per run
+struct MembershipRun {
+    int64 first_time;
+    int64 last_time;
+    uint32 joined = 0;
+    uint32 left = 0;
+    std::vector<std::string> names; // first few distinct names, for the summary
+};
+
+// Sparse index over the append only history, so finding a time is a binary
+// search over a small contiguous array plus one over a single block
+class TimeIndex {
+public:
+    void Append( const std::vector<ChatMessage>& messages );
+    void Clear() { samples.clear(); }
+
+    // First message at or after `timestamp`, messages.size() if there is none
+    size_t LowerBound( const std::vector<ChatMessage>& messages, int64 timestamp ) const;
+
+private:
+    std::vector<int64> samples; // timestamp of messages[i * TIME_INDEX_STRIDE]
+};
+
+// Per lobby timestamp of the newest message the user has seen, kept across runs
+class ReadWatermarks {
+public:
+    void Load( const char* path );
+    void Save( const char* path );
+    void SaveIfDirty( const char* path );
+
+    int64 Get( uint64 lobby ) const;
+    void Advance( uint64 lobby, int64 timestamp );
+
+private:
+    std::unordered_map<uint64, int64> watermarks;
+    bool dirty = false;
+    double last_save = 0;
+};
+
+static ReadWatermarks read_watermarks;
+
+// Scroll state of the message list. Offsets are in pixels from the top of the history
+static struct {
+    float scroll = 0;
+    float velocity = 0;
+    float target = -1;          // set while animating a jump, -1 otherwise
+    bool stick_to_bottom = true;
+    int64 unread_after = -1;    // the watermark when the lobby was opened, marks where unread starts
+    bool jump_edit = false;
+    char jump_text[32] = "";
+} chat_view;
+
+class RichTextParser {
+public:
+    // Parses **bold**, *italic*, ~~strike~~, `code`, @mentions and http(s) links
+    static void Parse( const std::string& text, std::vector<TextSpan>& spans );
+
+    // Offset of the next byte that can start or end markup, or `len`
+    static size_t FindDelimiter( const char* text, size_t pos, size_t len );
+    static size_t FindDelimiterScalar( const char* text, size_t pos, size_t len );
+
+    // Prints parse throughput for the SIMD and scalar scanners
+    static int Benchmark();
+};
+
+enum eWidget : uint8 {
+    W_ROOT = 0,
+    W_LOADING_TEXT,
+    W_OUTSIDE_CREATE,
+    W_OUTSIDE_JOIN,
+    W_OUTSIDE_BROWSE,
+    W_OUTSIDE_QUIT,
+    W_OUTSIDE_BACK,
+    W_FORM_TEXTBOX,        // lobby name or lobby id, depending on the screen
+    W_FORM_BUTTON,
+    W_LOBBY_MEMBERS,
+    W_LOBBY_MEMBER_FILTER,
+    W_LOBBY_MEMBER_SORT,
+    W_LOBBY_MEMBER_LIST,
+    W_LOBBY_CHAT,
+    W_LOBBY_CHAT_BOX,
+    W_LOBBY_TYPING,
+    W_LOBBY_MESSAGE_LIST,
+    W_LOBBY_JUMP_BOX,
+    W_LOBBY_UNREAD_BUTTON,
+    W_LOBBY_TABS,
+    W_LOBBY_DIAGNOSTICS,
+    W_BROWSER_BACK,
+    W_BROWSER_FILTER,
+    W_BROWSER_FREE_SLOTS,
+    W_BROWSER_REFRESH,
+    W_BROWSER_LIST,
+    W_BROWSER_PREV,
+    W_BROWSER_STATUS,
+    W_BROWSER_NEXT,
+    WIDGET_COUNT
+};
+
+// A node's rectangle, relative to its parent's:
+//   width  = parent.width * w_frac + w_px, capped at w_max if that's set
+//   x      = parent.x + (parent.width - width) * align_x + dx
+// and the same for the height and y. With `above` set, the bottom edge stops
+// at the top of that node, which has to come earlier in the layout
+struct LayoutNode {
+    eWidget id;
+    eWidget parent = W_ROOT;
+    eWidget above = W_ROOT;
+    float w_frac = 0, w_px = 0, w_max = 0;
+    float h_frac = 0, h_px = 0, h_max = 0;
+    float align_x = 0, align_y = 0;
+    float dx = 0, dy = 0;
+    bool visible = true; // hidden nodes keep their place but don't take hits
+    Rectangle bounds = { 0, 0, 0, 0 };
+};
+
+// Retained layout for one screen. Rectangles are worked out once and kept until
+// the window is resized or a node changes size, so drawing and hit testing read
+// cached geometry instead of redoing the math every frame
+class Layout {
+public:
+    // Nodes go in parent first order, the root covering the window is implicit
+    LayoutNode& Add( eWidget id, eWidget parent = W_ROOT );
+
+    // Recomputes if the window size changed since the last pass
+    void Update();
+
+    const Rectangle& Get( eWidget id );
+
+    // Fixed pixel size of a node, for content driven sizes like the chat box
+    void Resize( eWidget id, float w_px, float h_px );
+    void SetVisible( eWidget id, bool visible );
+
+    // Last visible node under `point`, W_ROOT if none. Later nodes draw on top
+    eWidget HitTest( Vector2 point );
+
+    // One prebuilt layout per eScreenState
+    static void BuildScreens();
+
+private:
+    void Compute();
+
+    std::vector<LayoutNode> nodes;
+    std::array<int16_t, WIDGET_COUNT> slots = {}; // index into nodes + 1, 0 if not in this layout
+    int width = -1;
+    int height = -1;
+    bool dirty = true;
+};
+
+static Layout screen_layouts[eScreenState::LOBBY_BROWSER + 1];
+
 class Screen {
 public:
     static void renderOutsideLobby();
@@ -36,354 +387,6439 @@ public:
     static void renderLobbyJoin();
     static void renderLobby();
     static void renderLoading();
+    static void renderLobbyBrowser();
+
+    static void renderMessage( const ChatMessage& message, Vector2 position, float size, size_t from = 0 );
+    static void renderMembershipRow( const MembershipRun& run, Vector2 position, float size );
+    static void renderMessageList( Rectangle bounds, float row_height, float font_size );
+    static void renderMemberList( Rectangle bounds, float row_height, float font_size );
+    static void renderTypingLine( Rectangle bounds, float font_size );
+    static void renderTabs( Rectangle bounds );
+    static void resetChatView();
 };
 
-class LobbyManager {
+// Parses "14:00", "yesterday 14:00" or "2024-05-01 14:00" as local time, -1 if it can't
+int64 ParseJumpTime( const char* text );
+
+// Our relay network location as a string for lobby data, false until it's measured
+bool LocalPingLocation( char* text, int size );
+
+enum eMembershipNotice { NOTICE_NONE = 0, NOTICE_JOINED, NOTICE_LEFT };
+
+// Recognizes the "[SERVER]: <name> has Joined/Left the lobby" notices, sets `name` to <name>
+eMembershipNotice ParseMembershipNotice( const char* text, size_t size, std::string* name );
+
+// Text with a movable hole at the edit point, so typing and pasting only
+// move the bytes between the previous and the new edit position
+class GapBuffer {
+public:
+    size_t Size() const { return data.size() - (gap_end - gap_start); }
+    char At( size_t pos ) const { return pos < gap_start ? data[pos] : data[pos + (gap_end - gap_start)]; }
+
+    void Insert( size_t pos, const char* text, size_t len );
+    void Erase( size_t pos, size_t len );
+    std::string Substr( size_t pos, size_t len ) const;
+    void Clear() { data.clear(); gap_start = gap_end = 0; }
+
+private:
+    void MoveGap( size_t pos );
+
+    std::vector<char> data;
+    size_t gap_start = 0;
+    size_t gap_end = 0;
+};
+
+// Multi-line chat input. Enter sends, Shift+Enter starts a new line.
+// Line lengths are cached and patched on every edit, and positions are found by
+// walking from the last located one, so typing costs the same at any buffer size
+class ChatInput {
+public:
+    bool focused = true;
+
+    // Handles input and draws the box. Returns true when the user hit Enter
+    bool Update( Rectangle bounds, float font_size );
+    float Height( float font_size ) const;
+
+    std::string Text() const { return buffer.Substr( 0, buffer.Size() ); }
+    size_t Size() const { return buffer.Size(); }
+    void Clear();
+    // GetTime() of the last edit, -1 before the first
+    double LastEdit() const { return last_edit; }
+
+private:
+    struct Edit {
+        size_t pos;
+        std::string removed;
+        std::string inserted;
+        size_t cursor_before;
+        size_t cursor_after;
+        double time;
+    };
+
+    struct Location {
+        size_t pos;
+        size_t line;
+        size_t column;
+    };
+
+    void Replace( size_t begin, size_t end, const char* text, size_t len, bool coalesce );
+    void ApplyErase( size_t pos, size_t len );
+    void ApplyInsert( size_t pos, const char* text, size_t len );
+    void Undo();
+    void Redo();
+
+    Location Locate( size_t pos );
+    size_t LineStart( size_t line );
+    size_t PrevCodepoint( size_t pos ) const;
+    size_t NextCodepoint( size_t pos ) const;
+    void MoveCursor( size_t pos, bool select );
+    void MoveVertical( int lines, bool select );
+    void HandleKeys();
+    void Draw( Rectangle bounds, float font_size );
+
+    GapBuffer buffer;
+    std::vector<uint32> line_lengths { 0 }; // bytes per line, without the '\n'
+    Location known { 0, 0, 0 };            // last located position, where walks start from
+    size_t cursor = 0;
+    size_t anchor = 0;                     // other end of the selection, == cursor when nothing is selected
+    size_t scroll_line = 0;
+    size_t scroll_column = 0;
+    std::vector<Edit> undo_stack;
+    std::vector<Edit> redo_stack;
+    double last_edit = -1;
+};
+
+static ChatInput chat_input;
+
+// Collects the parts of split messages until they're complete. Incomplete
+// messages are dropped after MULTIPART_TIMEOUT, or oldest first once the
+// buffered parts go over MULTIPART_MAX_PENDING_BYTES
+class MessageReassembler {
+public:
+    static bool IsPart( const char* data, int size );
+
+    // True once `data` completed a message, which is then moved into `out`
+    bool Add( uint64 sender, const char* data, int size, std::string& out );
+    void Expire();
+    void Clear();
+
+private:
+    struct Pending {
+        std::vector<std::string> parts;
+        std::vector<bool> arrived; // per part, a part's payload can be empty
+        uint16 received = 0;
+        size_t bytes = 0;
+        double first_seen = 0;
+    };
+
+    void Drop( std::map<std::pair<uint64, uint32>, Pending>::iterator it );
+
+    std::map<std::pair<uint64, uint32>, Pending> pending; // by (sender, message id)
+    size_t pending_bytes = 0;
+};
+
+// The members panel. Members stay in sort order as they join, leave or get
+// renamed, each change is a binary search and one insert or erase. A second
+// order by folded name is the prefix index the type-ahead filter searches
+class MemberList {
+public:
+    enum eSortMode { SORT_NAME = 0, SORT_STATUS };
+
+    void Reset( const std::vector<uint64>& ids );
+    void Add( uint64 id );
+    void Remove( uint64 id );
+    void Clear();
+    // Adds a member as the session snapshot last saw them, without asking Steam
+    void Restore( uint64 id, const std::string& name, int status_rank );
+
+    // Looks up names and status for new or changed members. Needs Steam, so it
+    // runs once a frame on the main thread rather than from Add
+    void Update();
+
+    void SetSort( eSortMode mode );
+    eSortMode Sort() const { return sort; }
+    void SetFilter( const char* text );
+
+    size_t Size() const { return members.size(); }
+    // Members to draw, sorted and filtered
+    const std::vector<uint64>& Visible();
+    const std::string& Name( uint64 id ) const;
+    bool Away( uint64 id ) const;
+
+    float scroll = 0;
+    bool filter_edit = false;
+    char filter_text[64] = "";
+
+private:
+    struct Member {
+        uint64 id;
+        std::string name;
+        std::string folded; // ASCII lowercase name, the prefix index key
+        int status_rank = 0; // 0 online, 1 away or busy, 2 offline
+    };
+
+    static std::string Fold( const std::string& text );
+    bool Less( const Member* a, const Member* b ) const;
+    static bool LessFolded( const Member* a, const Member* b );
+    void Insert( Member* member );
+    void Erase( Member* member );
+
+    STEAM_CALLBACK( MemberList, OnPersonaStateChange, PersonaStateChange_t );
+
+    std::unordered_map<uint64, Member> members; // nodes don't move, the orders below point into it
+    std::vector<Member*> order;        // by the current sort mode
+    std::vector<Member*> prefix_index; // by (folded, id)
+    std::vector<uint64> pending;       // waiting for Update to fetch their persona
+    std::vector<uint64> visible;
+    std::string filter;                // folded
+    eSortMode sort = SORT_NAME;
+    bool visible_dirty = true;
+};
+
+static MemberList member_list;
+
+// Everything about one lobby we're in. The displayed lobby's lives in lobby_manager,
+// the others are parked in SessionManager as bare LobbySessions: no member index,
+// chat view or presence, they only take in chat entries and member changes
+class LobbySession {
 public:
-    char lobby_name[100]; // text box data, that u type to create a lobby
-    char lobby_id_text_box[200]; // same as above, but u type the id to join an existing id
     std::string lobby_leader;
     std::vector<uint64> members;
-    std::vector<std::string> messages;
+    std::vector<ChatMessage> messages;
+    std::vector<MessageRow> rows;
+    std::vector<MembershipRun> membership_runs;
+    TimeIndex time_index;
+    MessageReassembler reassembler;
+    uint32 next_message_id = 0;
+
+    uint64 id = 0;
+    uint64 owner = 0;         // as of the last CheckOwner
+    uint64 history_lobby = 0; // the lobby `messages` belong to, kept on rejoin
+    bool ping_location_published = true; // only the host publishes one, see PublishPingLocation
+    bool roster_dirty = false;
+    double roster_published = -1;
+
+    // The chat view as it was when the tab was left
+    float parked_scroll = 0;
+    bool parked_at_bottom = true;
+
+    // Shown in a tab, as opposed to parked in the background
+    bool Foreground() const;
+
+    // Puts the host's ping location in the lobby data for the browser's ranking.
+    // Relay access takes a few seconds to come up, so this is retried until it works
+    void PublishPingLocation();
+    // Owner only: puts the member ids in the lobby data for LobbyPrefetcher,
+    // and the elected successor next to them
+    void PublishRoster();
+
+    // Who should own the lobby after the current owner: the lowest id among the
+    // other members that aren't idle, or among all of them if everyone is.
+    // Only reads published state, so every client comes to the same answer
+    uint64 Successor() const;
+    // Notices ownership moving. When it moves to us, hands it on to the elected
+    // successor if Steam picked someone else, or takes over the owner's duties
+    void CheckOwner();
+    // Hands ownership on if it's ours, then leaves
+    void Leave();
+
+    // Steam independent halves of SessionManager's callbacks, the replayer drives these directly
+    void HandleChatEntry( uint64 sender, const char* data, int size );
+    void AppendMessage( const char* text, size_t size );
+    // `received` in unix ms, for history that arrived in an earlier session
+    void AppendMessage( const char* text, size_t size, int64 received );
+    // A join / leave run as it was saved, never merged with the one above
+    void AppendRun( MembershipRun run );
+    void HandleMemberChange( uint64 member, uint32 state_change );
+
+    // Row drawing messages[index], rows.size() past the end
+    size_t RowOf( size_t index ) const { return index < messages.size() ? messages[index].row : rows.size(); }
+};
+
+// The displayed lobby, and creating, joining and leaving
+class LobbyManager : public LobbySession {
+public:
+    char lobby_name[100]; // text box data, that u type to create a lobby
+    char lobby_id_text_box[200]; // same as above, but u type the id to join an existing id
+
+    void CreateLobby();
+    void JoinLobby(uint64 SteamID);
+    // Through SessionManager::Close, which keeps the tabs in step
+    void LeaveLobby();
+    void SendMessage(std::string sender, std::string msg);
+
+    void reFillMembersVector();
+
+private:
+    // call Values
+    // where u handle the lobby creation. Till this is called, we show a Loading Screen
+    void OnLobbyCreate( LobbyCreated_t *pCallback, bool bIOFailure );
+    CCallResult< LobbyManager, LobbyCreated_t > m_LobbyCreateCallResult;
+
+    void OnLobbyJoin( LobbyEnter_t *pCallback, bool bIOFailure );
+    CCallResult< LobbyManager, LobbyEnter_t > m_LobbyJoinCallResult;
+};
+
+static LobbyManager lobby_manager;
+
+// Every lobby we're in, one tab each. Only the active tab is a full LobbyManager
+// with its member list, chat view and presence; switching tabs swaps session
+// state in and out of lobby_manager. Lobby callbacks are dispatched here, routed
+// by lobby id to whichever object holds that lobby right now
+class SessionManager {
+public:
+    // The displayed lobby got its id, from joining or creating
+    void Opened();
+    // Moves the displayed lobby into the background, lobby_manager is left empty
+    void Park();
+    // Shows the tab for `lobby`. False if there's none, or a join is still going
+    bool Switch( uint64 lobby );
+    // Leaves `lobby` and drops its tab, showing another one if it was displayed
+    void Close( uint64 lobby );
+    void CloseAll();
+
+    // Owner duties for every lobby, displayed or not. From the main loop
+    void Update();
+
+    bool Has( uint64 lobby ) const { return routes.count( lobby ) != 0; }
+    // Whether `member` is in any lobby we're in
+    bool Shares( uint64 member ) const;
+    const std::vector<uint64>& Tabs() const { return tabs; }
+    // Messages past the read watermark of a background tab
+    size_t Unread( uint64 lobby ) const;
+
+private:
+    LobbySession* Find( uint64 lobby ) const;
+    void Activate();
+
+    STEAM_CALLBACK( SessionManager, OnLobbyChatUpdate, LobbyChatUpdate_t );
+    STEAM_CALLBACK( SessionManager, OnLobbyChatMsg, LobbyChatMsg_t );
+    // SetLobbyOwner hand offs only show up here, not as a LobbyChatUpdate_t
+    STEAM_CALLBACK( SessionManager, OnLobbyDataUpdate, LobbyDataUpdate_t );
+
+    std::unordered_map<uint64, LobbySession*> routes; // lobby -> lobby_manager or a parked session
+    std::unordered_map<uint64, std::unique_ptr<LobbySession>> parked;
+    std::vector<uint64> tabs; // in the order they were opened
+};
+
+static SessionManager session_manager;
+
+// Lobby data, parsed once per change. A lobby's whole key set is read in one pass
+// with GetLobbyDataByIndex and kept until LobbyDataUpdate_t says that lobby's data
+// changed, so per frame reads are a hash lookup instead of a call into Steam
+class LobbyMetadata {
+public:
+    struct Info {
+        std::string name;
+        std::string leader;
+        std::string app;
+        std::string ping_location;
+        int version = 0;
+        uint64 room = 0;   // sharding, see ShardManager
+        int shard = 0;
+        uint64 parent = 0;
+        uint64 child = 0;
+        std::vector<uint64> roster; // some of the members, see LobbySession::PublishRoster
+        uint64 successor = 0;       // who the owner elected to take over, see LobbySession::Successor
+        std::unordered_map<std::string, std::string> values; // every key, typed or not
+    };
+
+    // Cached info, read from Steam first if it's missing or was invalidated
+    const Info& Get( uint64 lobby );
+    // Re-reads now. For lobby list results, which don't send LobbyDataUpdate_t
+    const Info& Refresh( uint64 lobby );
+    const std::string& Value( uint64 lobby, const std::string& key );
+
+    void Invalidate( uint64 lobby );
+    void Forget( uint64 lobby ) { lobbies.erase( lobby ); }
+
+private:
+    STEAM_CALLBACK( LobbyMetadata, OnLobbyDataUpdate, LobbyDataUpdate_t );
+
+    struct Entry {
+        Info info;
+        bool stale = true;
+    };
+    std::unordered_map<uint64, Entry> lobbies;
+};
+
+static LobbyMetadata lobby_metadata;
+
+// Warms the caches for a lobby the user is likely to join: hovered in the browser
+// or invited to. The lobby data comes from RequestLobbyData, and personas and
+// avatars of its roster are fetched once it arrives, so by the time OnLobbyJoin
+// runs the first frame of the lobby screen has names and faces
+class LobbyPrefetcher {
+public:
+    void Prefetch( uint64 lobby );
+
+private:
+    void Warm( const LobbyMetadata::Info& info );
+
+    STEAM_CALLBACK( LobbyPrefetcher, OnLobbyDataUpdate, LobbyDataUpdate_t );
+    STEAM_CALLBACK( LobbyPrefetcher, OnLobbyInvite, LobbyInvite_t );
+    STEAM_CALLBACK( LobbyPrefetcher, OnJoinRequested, GameLobbyJoinRequested_t );
+
+    struct Request {
+        double time;
+        bool waiting; // for its LobbyDataUpdate_t
+    };
+    std::unordered_map<uint64, Request> requests;
+};
+
+static LobbyPrefetcher lobby_prefetcher;
+
+enum eJoinStage {
+    JOIN_ENTER = 0,  // JoinLobby's LobbyEnter_t
+    JOIN_METADATA,   // lobby data, and the roster as a preview of the members
+    JOIN_MEMBERS,    // personas of everyone actually in the lobby
+    JOIN_HISTORY,    // message store and chat view for this lobby
+    JOIN_AVATARS,    // avatars of the first rows of the members panel
+    JOIN_STAGE_COUNT
+};
+
+// Joining as independent stages instead of a loading screen. The lobby screen is
+// up from the moment the join starts and each stage fills in its part when it
+// completes, in whatever order that happens. Measures time to first paint and
+// to interactive (entered, lobby data and member names in), per join
+class JoinPipeline {
+public:
+    // User asked to join `lobby`, or the room it belongs to
+    void Start( uint64 lobby );
+    // Rejoining the lobby a session snapshot put on screen, which stays as it is
+    void Resume( uint64 lobby );
+    // The lobby actually being joined, once it's known. Starts a pipeline if there isn't one
+    void Target( uint64 lobby );
+    void OnEntered( const std::vector<uint64>& members );
+    void Fail();
+
+    // Polls the stages that have nothing to call back on, once a frame
+    void Update();
+    void OnPaint();
+
+    bool Active() const { return active; }
+    bool Done( eJoinStage stage ) const { return done & (1u << stage); }
+    bool Interactive() const { return !active || (Done( JOIN_ENTER ) && Done( JOIN_METADATA ) && Done( JOIN_MEMBERS )); }
+    uint64 Lobby() const { return lobby; }
+    // Stages still running, for the lobby header
+    std::string Status() const;
+
+private:
+    void Begin();
+    void Complete( eJoinStage stage );
+    void Finish();
+
+    STEAM_CALLBACK( JoinPipeline, OnLobbyDataUpdate, LobbyDataUpdate_t );
+    STEAM_CALLBACK( JoinPipeline, OnPersonaStateChange, PersonaStateChange_t );
+
+    bool active = false;
+    uint64 lobby = 0;
+    uint32 done = 0;
+    uint64 start_us = 0;
+    uint64 entered_us = 0;
+    uint64 stage_us[JOIN_STAGE_COUNT] = {};
+    uint64 first_paint_us = 0;
+    uint64 interactive_us = 0;
+    std::vector<uint64> unresolved; // members whose persona Steam is still fetching
+    std::vector<uint64> avatar_members;
+};
+
+static JoinPipeline join_pipeline;
+
+// The last session, written on exit: lobby id, the tail of its history with its
+// join / leave runs, members
+// with names and avatars, and view state. Flat and offset addressed, so it's
+// mapped and read in place with no parsing step. Restoring puts the lobby on
+// screen at launch, JoinPipeline::Resume then rejoins and reconciles with Steam
+class SessionSnapshot {
+public:
+    // Maps the file and checks that every section is in bounds
+    bool Open( const char* path );
+    void Close();
+
+    // For InitWindow, so the window comes back at its old size
+    void WindowSize( int* width, int* height ) const;
+    // Copies the snapshot into the lobby, member list, avatars and views.
+    // Returns the lobby to rejoin, 0 if the session ended outside one
+    uint64 Restore();
+
+    // Writes to a temporary file first, so a failed save leaves the old snapshot
+    static bool Save( const char* path );
+
+private:
+    struct Text {
+        uint32 offset; // into the string section
+        uint32 size;
+    };
+    struct Header {
+        char magic[4];
+        uint32 version;
+        uint64 lobby;
+        int64 saved_at; // unix ms
+        int32 window_width;
+        int32 window_height;
+        float scroll;
+        uint8 stick_to_bottom;
+        uint8 member_sort;
+        uint16 reserved;
+        uint32 message_count, messages_offset;
+        uint32 run_count, runs_offset;
+        uint32 member_count, members_offset;
+        uint32 avatar_count, avatars_offset;
+        uint32 strings_offset, strings_size;
+        Text lobby_name, lobby_leader, member_filter;
+    };
+    struct Message {
+        int64 timestamp;
+        Text text;
+    };
+    // A join / leave run, drawn above message `before`
+    struct Run {
+        int64 first_time;
+        int64 last_time;
+        uint32 joined;
+        uint32 left;
+        uint32 before;
+        uint32 reserved;
+        Text names; // '\n' separated
+    };
+    struct Member {
+        uint64 id;
+        Text name;
+        int32 status_rank;
+        uint32 reserved;
+    };
+    struct Avatar {
+        uint64 id;
+        uint8 pixels[AVATAR_SIZE * AVATAR_SIZE * 4];
+    };
+
+    // NULL if the section doesn't fit the file
+    template <typename T>
+    const T* Section( uint32 offset, uint32 count ) const;
+    std::string String( Text text ) const;
+    const Header& header() const { return *reinterpret_cast<const Header*>( data ); }
+
+    const uint8* data = NULL;
+    size_t size = 0;
+#ifdef _WIN32
+    std::vector<uint8> buffer; // no mmap, read in one go instead
+#endif
+};
+
+static SessionSnapshot session_snapshot;
+
+// Published as the decimal value of the "presence" member data. No flags is
+// also what members without this feature look like: active, not typing
+enum ePresenceFlag : uint8 {
+    PRESENCE_IDLE   = 1 << 0,
+    PRESENCE_TYPING = 1 << 1,
+};
+
+// Our own typing and idle state goes out as lobby member data, which Steam
+// rate limits, so a write happens only when the state differs from what was
+// last published and at most once per `interval`. Every change in between
+// collapses into that one write. Other members' states are kept as one bit
+// per member slot for each flag, cheap enough to query for every drawn row
+class Presence {
+public:
+    double interval = PRESENCE_DEFAULT_INTERVAL;
+
+    // Works out our state from input and the chat box, publishes it when allowed.
+    // Every frame on every screen, so input outside the lobby screen counts too
+    void Update();
+    // Reads everyone's state on entering `lobby`, 0 when leaving
+    void Reset( uint64 lobby, const std::vector<uint64>& members );
+    void Forget( uint64 member );
+
+    bool Idle( uint64 member ) const { return Test( idle, member ); }
+    bool Typing( uint64 member ) const { return Test( typing, member ); }
+    // Everyone typing but us, in the order they started
+    const std::vector<uint64>& TypingMembers() const { return typing_members; }
+
+private:
+    void Read( uint64 member );
+    void Set( uint64 member, uint8 flags );
+    bool Test( const std::vector<uint64>& bits, uint64 member ) const;
+    static void Assign( std::vector<uint64>& bits, uint32 slot, bool value );
+
+    STEAM_CALLBACK( Presence, OnLobbyDataUpdate, LobbyDataUpdate_t );
+
+    uint64 lobby = 0;
+    uint64 self = 0;
+    std::unordered_map<uint64, uint32> slots; // member -> bit index in the maps below
+    std::vector<uint32> free_slots;
+    std::vector<uint64> idle;
+    std::vector<uint64> typing;
+    std::vector<uint64> typing_members;
+
+    uint8 published = 0xff; // what the lobby has for us, 0xff before the first write
+    double last_publish = -1;
+    double last_input = 0;
+    Vector2 last_mouse = { 0, 0 };
+};
+
+static Presence presence;
+
+// Public lobbies from RequestLobbyList, cached by id. Each result set is diffed
+// against the cache, so rows that didn't change keep their prebuilt label and
+// the text filter and paging work on the cache while a query is in flight
+class LobbyBrowser {
+public:
+    struct Entry {
+        uint64 id;
+        std::string name;
+        std::string leader;
+        int members = 0;
+        int max_members = 0;
+        std::string ping_location;          // as published by the host
+        SteamNetworkPingLocation_t location; // parsed once per distinct ping_location
+        bool has_location = false;
+        int ping = -1;                       // estimated round trip in ms, -1 unknown
+        uint64 room = 0;                     // first lobby of the room, 0 if never sharded
+        int shard = 0;
+        // Set on the lowest shard of each room, the only one listed
+        bool head = true;
+        int room_members = 0, room_max_members = 0, room_shards = 1;
+        std::string label;  // what the row shows, rebuilt only when the lobby changes
+        std::string folded; // lowercase name and leader for the text filter
+        uint32 seen = 0;    // last query generation that returned it
+    };
+
+    // Sends a query with the current filters, or queues one if a query is in flight
+    void Refresh();
+    // Refreshes every LOBBY_BROWSER_REFRESH_INTERVAL while the browser is open
+    void Update();
+    bool Busy() const { return in_flight; }
+
+    void SetFilter( const char* text );
+    void SetFreeSlotsOnly( bool only );
+
+    // One entry per room passing the text filter, nearest first
+    const std::vector<const Entry*>& Visible();
+
+    int page = 0;
+    bool free_slots_only = false;
+    bool filter_edit = false;
+    char filter_text[64] = "";
+
+    // Outcome of the last query, for the status line
+    double last_refresh = -1;
+    uint32 added = 0, changed = 0, removed = 0;
+
+private:
+    void OnLobbyList( LobbyMatchList_t *pCallback, bool bIOFailure );
+    CCallResult< LobbyBrowser, LobbyMatchList_t > m_LobbyListCallResult;
+
+    // True if the estimate changed, and the label was rebuilt with it
+    bool EstimatePing( Entry& entry );
+    static void BuildLabel( Entry& entry );
+    double last_ping_check = -1;
+
+    std::unordered_map<uint64, Entry> entries;
+    std::vector<const Entry*> visible;
+    std::string filter; // folded
+    uint32 generation = 0;
+    bool in_flight = false;
+    bool queued = false;
+    bool visible_dirty = true;
+};
+
+static LobbyBrowser lobby_browser;
+
+// Splits a room over several lobbies and keeps it one conversation. Shards carry
+// "room" (the first lobby's id), "shard" and "parent" lobby data, and the owner of
+// each shard also sits in its parent as the bridge that relays chat both ways.
+// Relayed entries keep their origin, so every client drops copies that came back
+// to their own shard or arrived over two paths
+class ShardManager {
+public:
+    struct Envelope {
+        uint64 origin_lobby;
+        uint32 origin_chat_id;
+        uint64 sender;
+        uint64 Key() const;
+    };
+
+    static bool IsRelay( const char* data, int size );
+    static Envelope Unwrap( const char* data );
+
+    // Joins the least loaded shard of the room `lobby` belongs to, or `lobby` itself
+    void JoinRoom( uint64 lobby );
+    // RequestLobbyList filters and results are shared by the whole process, so the
+    // room lookup and LobbyBrowser's queries take turns: each waits for the other's
+    bool Querying() const { return room_query_in_flight; }
+    // Sends the room lookup that was waiting for the browser's query, if any
+    void SendQueuedQuery();
+
+    // Spawns shards and rejoins parents as a bridge where needed, from the main loop
+    void Update();
+    // Ownership changed hands, so the next Update runs without waiting out the interval
+    void Recheck() { last_check = -1; }
+    // The lobby whose room this bridges
+    uint64 Home() const { return home; }
+
+    // A chat entry from the displayed lobby or one we bridge, forwarded to the others
+    void Relay( uint64 from, uint32 chat_id, uint64 sender, const char* data, int size );
+    bool Bridges( uint64 lobby ) const;
+    bool Bridging() const { return !bridged.empty(); }
+    // False if this relayed message was already shown
+    bool FirstSighting( const Envelope& envelope ) { return seen.Insert( envelope.Key() ); }
+
+    void LeaveAll();
+
+private:
+    // Bounded set of the most recent ids
+    struct RecentIds {
+        bool Insert( uint64 key );
+        std::unordered_map<uint64, bool> keys;
+        std::deque<uint64> order;
+    };
+
+    void Spawn( uint64 full_lobby );
+    void OnShardCreated( LobbyCreated_t *pCallback, bool bIOFailure );
+    void OnBridgeJoined( LobbyEnter_t *pCallback, bool bIOFailure );
+    void QueryRoom();
+    void OnRoomList( LobbyMatchList_t *pCallback, bool bIOFailure );
+    CCallResult< ShardManager, LobbyCreated_t > m_ShardCreateCallResult;
+    CCallResult< ShardManager, LobbyEnter_t > m_BridgeJoinCallResult;
+    CCallResult< ShardManager, LobbyMatchList_t > m_RoomListCallResult;
+
+    uint64 home = 0;
+    std::vector<uint64> bridged; // lobbies we sit in besides home
+    uint64 spawning_from = 0;    // full shard a new one is being created for
+    uint64 joining_bridge = 0;
+    uint64 joining_room = 0;
+    bool room_query_in_flight = false;
+    bool room_query_queued = false;
+    double last_check = -1;
+    RecentIds seen;
+    RecentIds relayed;
+};
+
+static ShardManager shard_manager;
+
+// Fixed size ring buffer, oldest entry gets overwritten once it's full
+template <typename T, size_t N>
+class RingBuffer {
+public:
+    void push( const T& value ) {
+        data[head] = value;
+        head = (head + 1) % N;
+        if ( count < N ) count++;
+    }
+
+    // 0 is the oldest entry, size() - 1 the newest
+    const T& operator[]( size_t i ) const { return data[(head + N - count + i) % N]; }
+    const T& back() const { return data[(head + N - 1) % N]; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    void clear() { head = count = 0; }
+
+private:
+    std::array<T, N> data;
+    size_t head = 0;
+    size_t count = 0;
+};
+
+// Kept small on purpose, there is one of these per peer per second
+struct ConnectionSample {
+    int16 ping_ms;
+    uint8 quality_local;  // 0-100, -1 from steam (unknown) is stored as 255
+    uint8 quality_remote;
+    int32 send_rate;      // bytes / sec the transport is allowed to send
+    int32 out_bytes_per_sec;
+    int32 in_bytes_per_sec;
+    int32 pending_reliable;
+    int32 pending_unreliable;
+    uint8 lane_count;
+    struct {
+        int32 pending_reliable;
+        int32 pending_unreliable;
+        int32 queue_time_us;
+    } lanes[DIAG_MAX_LANES];
+};
+
+struct PeerDiagnostics {
+    ESteamNetworkingConnectionState state = k_ESteamNetworkingConnectionState_None;
+    std::string name; // as of the last poll
+    RingBuffer<ConnectionSample, DIAG_HISTORY_SIZE> history;
+};
+
+// Chat goes over lobby messages, which have no stats of their own, so the panel
+// measures the path to each member over a P2P probe connection. While it's open
+// it dials up to DIAG_MAX_PEERS members of the displayed lobby, and accepts probes
+// from anyone we share a lobby with. A probe stays up until the peer is gone
+class Diagnostics {
+public:
+    bool visible = false;
+
+    // Opens the listen socket probes arrive on. After SteamAPI_Init
+    void Listen();
+    // Polls GetConnectionRealTimeStatus for every probe, at most once every
+    // DIAG_POLL_INTERVAL seconds, and dials or drops probes as members come and go
+    void Poll();
+    void Render( Rectangle bounds );
+    // Forgets the history, on leaving or switching lobbies. Probes are kept
+    void Clear();
+
+private:
+    void Drop( uint64 peer );
+
+    STEAM_CALLBACK( Diagnostics, OnConnectionStatusChanged, SteamNetConnectionStatusChangedCallback_t );
+
+    double last_poll = 0;
+    ESteamNetworkingAvailability relay_status = k_ESteamNetworkingAvailability_Unknown;
+    HSteamListenSocket listen_socket = k_HSteamListenSocket_Invalid;
+    std::unordered_map<uint64, HSteamNetConnection> probes;
+    std::unordered_map<uint64, PeerDiagnostics> peers;
+};
+
+static Diagnostics diagnostics;
+
+// Chrome trace event format, load the dump in Perfetto or chrome://tracing
+// Names have to be string literals, only the pointer is stored
+struct TraceEvent {
+    const char* name;
+    const char* category;
+    char phase;     // 'X' span, 's' / 't' / 'f' flow start / step / end
+    uint64 ts_us;
+    uint64 dur_us;
+    uint64 id;      // flow id, 0 for spans
+};
+
+// Only the owning thread writes, the dump reads up to `count` so no locks on the hot path
+struct TraceBuffer {
+    uint32 tid;
+    std::atomic<size_t> count { 0 };
+    size_t dropped = 0;
+    std::unique_ptr<TraceEvent[]> events { new TraceEvent[TRACE_BUFFER_EVENTS] };
+};
+
+class Tracer {
+public:
+    bool enabled = false;
+    // Messages that already got their render flow event, see Screen::renderLobby
+    size_t rendered_messages = 0;
+
+    static uint64 Now();
+    static uint64 FlowId( const char* text, size_t len );
+
+    void Span( const char* name, const char* category, uint64 start_us, uint64 end_us );
+    void Flow( const char* name, char phase, uint64 id );
+    bool Dump( const char* path );
+
+private:
+    void Push( const TraceEvent& event );
+    TraceBuffer* ThreadBuffer();
+
+    std::mutex registry_mutex; // only taken the first time a thread traces, and on dump
+    std::vector<std::unique_ptr<TraceBuffer>> buffers;
+};
+
+static Tracer tracer;
+
+// Records a span from construction until the end of the scope
+class TraceScope {
+public:
+    TraceScope( const char* name, const char* category ) : name( name ), category( category ) {
+        if ( tracer.enabled ) start = Tracer::Now();
+    }
+    ~TraceScope() {
+        if ( tracer.enabled ) tracer.Span( name, category, start, Tracer::Now() );
+    }
+
+private:
+    const char* name;
+    const char* category;
+    uint64 start = 0;
+};
+
+#define TRACE_CONCAT_( a, b ) a##b
+#define TRACE_CONCAT( a, b ) TRACE_CONCAT_( a, b )
+#define TRACE_SCOPE( name, category ) TraceScope TRACE_CONCAT( trace_scope_, __LINE__ )( name, category )
+
+// Binary log of the lobby callbacks, so real traffic can be replayed as a benchmark.
+// Layout: magic, version, then records of
+//   u8 type, varint time delta (us), callback fields, [varint size, chat entry bytes]
+enum eRecordType : uint8 {
+    RECORD_CHAT_MSG = 1,
+    RECORD_CHAT_UPDATE = 2,
+};
+
+class CallbackRecorder {
+public:
+    bool Open( const char* path );
+    void Close();
+    bool IsOpen() const { return file != NULL; }
+
+    void RecordChatMsg( const LobbyChatMsg_t* msg, const char* data, int size );
+    void RecordChatUpdate( const LobbyChatUpdate_t* update );
+
+private:
+    void WriteHeader( uint8 type );
+    void WriteVarint( uint64 value );
+    void WriteU64( uint64 value );
+
+    FILE* file = NULL;
+    uint64 last_us = 0;
+};
+
+static CallbackRecorder recorder;
+
+class CallbackReplayer {
+public:
+    // Feeds a recording into lobby_manager without touching Steam.
+    // With max_speed the original timing is ignored. Returns the process exit code
+    static int Run( const char* path, bool max_speed );
+};
+
+// Fake network conditions, applied through the global SteamNetworkingSockets config
+struct ImpairmentProfile {
+    const char* name;
+    float loss_pct;
+    int lag_ms;
+    float reorder_pct;
+    int reorder_ms;
+    int rate_limit;  // bytes / sec, 0 for unlimited
+};
+
+struct ImpairmentResult {
+    size_t delivered = 0;
+    size_t payload_bytes = 0;
+    double seconds = 0;
+    double wire_bytes = 0;    // integrated from m_flOutBytesPerSec, so includes headers and resends
+    std::vector<uint32> latencies_us;
+};
+
+size_t MetricsThreadShard();
+
+class Counter {
+public:
+    void Add( uint64 n = 1 ) { shards[MetricsThreadShard()].value.fetch_add( n, std::memory_order_relaxed ); }
+    uint64 Value() const;
+
+private:
+    struct alignas(64) Shard { std::atomic<uint64> value { 0 }; };
+    Shard shards[METRICS_SHARDS];
+};
+
+class Gauge {
+public:
+    void Set( int64 v ) { value.store( v, std::memory_order_relaxed ); }
+    int64 Value() const { return value.load( std::memory_order_relaxed ); }
+
+private:
+    std::atomic<int64> value { 0 };
+};
+
+class Histogram {
+public:
+    void Record( uint64 v );
+    // Prometheus exposition lines for this histogram, cumulative at every power of two
+    void Export( std::string& out, const char* name, const char* help ) const;
+
+    static size_t BucketIndex( uint64 v );
+    static uint64 BucketUpperBound( size_t index );
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64> buckets[HISTOGRAM_BUCKETS] = {};
+        std::atomic<uint64> sum { 0 };
+        std::atomic<uint64> count { 0 };
+    };
+    Shard shards[METRICS_SHARDS];
+};
+
+static struct Metrics {
+    Counter messages_sent;
+    Counter messages_received;
+    Counter bytes_sent;
+    Counter bytes_received;
+    Counter send_failures;
+    Counter messages_relayed;
+    Counter presence_writes;
+    Counter owner_migrations;
+    Counter members_joined;
+    Counter members_left;
+    Gauge history_size;
+    Gauge members;
+    Histogram callback_us;
+    Histogram frame_us;
+    Histogram join_first_paint_ms;
+    Histogram join_interactive_ms;
+
+    std::string Export() const;
+} metrics;
+
+// Records the lifetime of the scope into a histogram, in microseconds
+class HistogramTimer {
+public:
+    HistogramTimer( Histogram& histogram ) : histogram( histogram ), start( std::chrono::steady_clock::now() ) {}
+    ~HistogramTimer() {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        histogram.Record( std::chrono::duration_cast<std::chrono::microseconds>( elapsed ).count() );
+    }
+
+private:
+    Histogram& histogram;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Periodically writes metrics.Export() to a file and / or serves it on 127.0.0.1
+class MetricsExporter {
+public:
+    std::string file_path;
+    int http_port = 0;
+    double interval = METRICS_DEFAULT_INTERVAL;
+
+    bool Start();
+    void Update(); // once a frame, exports when the interval has passed
+    void Stop();
+
+private:
+    void Publish();
+    void ServeHttp();
+
+    double last_export = 0;
+    std::mutex snapshot_mutex;
+    std::string snapshot;
+    std::thread http_thread;
+    std::atomic<bool> stopping { false };
+    int listen_fd = -1;
+};
+
+static MetricsExporter metrics_exporter;
+
+// FNV-1a
+uint64 HashBytes( const char* data, size_t len );
+
+// Decodes one UTF-8 sequence, invalid bytes come back as U+FFFD consuming a single byte
+int DecodeUtf8( const char* text, int* bytes );
+
+struct ShapedRun;
+
+// Draws UTF-8 text from a growable SDF glyph atlas. Glyphs are rasterized the first
+// time they're used, and everything queued in a frame goes out in one batch on Flush()
+class TextRenderer {
+public:
+    // Metrics at FONT_BASE_SIZE. References stay valid until Unload()
+    struct Glyph {
+        Rectangle rec;      // in the atlas, zero sized for whitespace / failed glyphs
+        float offset_x;
+        float offset_y;
+        float advance;
+    };
+
+    bool Load( const char* path );
+    void Unload();
+    bool IsLoaded() const { return loaded; }
+    uint32 FontId() const { return font_id; }
+
+    // Returns the advance of the queued text, at `size` pixels
+    float Queue( const char* text, Vector2 position, float size, Color color );
+    float Queue( const char* text, size_t len, Vector2 position, float size, Color color );
+    float QueueRun( const ShapedRun& run, Vector2 position, float size, Color color );
+    float Measure( const char* text, float size );
+    float Measure( const char* text, size_t len, float size );
+    void Flush();
+
+    // Safe to call from the shaping thread, only the CPU side atlas is touched
+    const Glyph& GetGlyph( int codepoint );
+
+private:
+    struct Quad {
+        Rectangle src;
+        Rectangle dst;
+        Color color;
+    };
+
+    bool Reserve( int w, int h, Rectangle& rec );
+
+    bool loaded = false;
+    uint32 font_id = 0;
+    std::mutex glyph_mutex; // guards glyphs, atlas and the shelf
+    unsigned char* font_data = NULL;
+    int font_data_size = 0;
+
+    // CPU side copy of the atlas, uploaded in Flush() when glyphs were added
+    Image atlas = {};
+    Texture2D texture = {};
+    bool atlas_dirty = false;
+    bool atlas_grown = false;
+    int shelf_x = 0, shelf_y = 0, shelf_height = 0;
+
+    std::unordered_map<int, Glyph> glyphs;
+    std::vector<Quad> quads;
+    Shader sdf_shader = {};
+};
+
+static TextRenderer text_renderer;
+
+// A line of text in visual order with every glyph already positioned, in FONT_BASE_SIZE units.
+// Positions scale linearly with the SDF font, so one run serves every text size
+struct ShapedRun {
+    struct ShapedGlyph {
+        const TextRenderer::Glyph* glyph;
+        float x;
+    };
+
+    std::vector<ShapedGlyph> glyphs;
+    float advance = 0;
+
+    size_t Bytes() const { return sizeof( ShapedRun ) + glyphs.capacity() * sizeof( ShapedGlyph ); }
+};
+
+class TextShaper {
+public:
+    // Groups codepoints into clusters (combining marks, emoji ZWJ / modifier /
+    // variation sequences, flag pairs), orders them for display with a reduced
+    // UAX #9 bidi pass and positions the glyphs
+    static void Shape( const char* text, size_t len, ShapedRun& run );
+};
+
+// LRU of shaped runs keyed by (text hash, length, font). Received messages are
+// shaped ahead of time on a worker thread so drawing them is only a lookup
+class ShapingCache {
+public:
+    size_t budget = SHAPING_CACHE_BUDGET;
+
+    // Shapes on the calling thread on a miss
+    std::shared_ptr<const ShapedRun> Get( const char* text, size_t len );
+    void Prefetch( std::string text );
+
+    void Start();
+    void Stop();
+    void Clear();
+
+private:
+    struct Key {
+        uint64 hash;
+        uint32 length;
+        uint32 font;
+        bool operator==( const Key& other ) const { return hash == other.hash && length == other.length && font == other.font; }
+    };
+    struct KeyHash {
+        size_t operator()( const Key& key ) const { return key.hash ^ key.font; }
+    };
+    struct Entry {
+        Key key;
+        std::shared_ptr<const ShapedRun> run;
+        size_t bytes;
+    };
+
+    Key MakeKey( const char* text, size_t len ) const;
+    std::shared_ptr<const ShapedRun> Find( const Key& key );
+    void Insert( const Key& key, std::shared_ptr<const ShapedRun> run );
+    void Work();
+
+    std::mutex mutex;
+    std::list<Entry> lru; // front is the most recently used
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> index;
+    size_t used = 0;
+
+    std::thread worker;
+    std::condition_variable pending_cv;
+    std::deque<std::string> pending;
+    bool stopping = false;
+};
+
+static ShapingCache shaping_cache;
+
+// Member avatars, packed into one texture so the members panel is a single batch.
+// Steam hands out images on the main thread, copying and scaling them happens on
+// a worker and only the finished cell is uploaded from Update()
+class AvatarAtlas {
+public:
+    bool Load();
+    void Unload();
+    void Update();
+
+    // Draws the avatar if it's ready, requests it otherwise. Returns false while it isn't
+    bool Draw( uint64 member, Rectangle bounds );
+    // Gets it ready ahead of the first Draw
+    void Prefetch( uint64 member );
+    bool Ready( uint64 member ) const;
+    // Gives the member's cell back, once they're off every roster we hold
+    void Forget( uint64 member );
+
+    // Session snapshot side. Restored avatars are drawn until Steam's current one replaces them
+    void Restore( uint64 member, const uint8* pixels );
+    // Reads the atlas back once and copies out the cells of up to `max` of `members`
+    void Export( const std::vector<uint64>& members, size_t max, std::vector<uint64>& ids, std::vector<uint8>& pixels );
+
+private:
+    enum eAvatarState {
+        AVATAR_WAITING,  // for RequestUserInformation or AvatarImageLoaded_t
+        AVATAR_DECODING,
+        AVATAR_READY,
+    };
+
+    struct Avatar {
+        eAvatarState state;
+        int slot;
+        bool drawable = false; // the cell holds an image, possibly an older one
+        bool stale = false;    // restored, not yet asked for again
+        double used = 0;       // last drawn or asked for
+    };
+
+    struct Job {
+        uint64 member;
+        int image;
+        int slot;
+        std::vector<uint8> pixels; // filled by the worker, AVATAR_SIZE x AVATAR_SIZE RGBA
+    };
+
+    void Request( uint64 member );
+    // A free cell, or the least recently used one's. -1 if all of them are in use
+    int TakeSlot();
+    void Decode( Job& job );
+    void Work();
+    Rectangle SlotRect( int slot ) const;
+
+    STEAM_CALLBACK( AvatarAtlas, OnAvatarLoaded, AvatarImageLoaded_t );
+    STEAM_CALLBACK( AvatarAtlas, OnPersonaStateChange, PersonaStateChange_t );
+
+    bool loaded = false;
+    Texture2D texture = {};
+    std::unordered_map<uint64, Avatar> avatars;
+    std::vector<int> free_slots;
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable jobs_cv;
+    std::deque<Job> jobs;
+    std::vector<Job> done;
+    bool stopping = false;
+};
+
+static AvatarAtlas avatars;
+
+class NetworkBenchmark {
+public:
+    // Sends chat sized reliable messages over a CreateSocketPair loopback
+    // connection for every profile and prints latency, goodput and overhead
+    static int Run();
+
+private:
+    static void ApplyProfile( const ImpairmentProfile& profile );
+    static bool RunProfile( const ImpairmentProfile& profile, ImpairmentResult& result );
+};
+
+int main( int argc, char** argv ) {
+    const char* record_path = NULL;
+    const char* font_path = FONT_PATH;
+    const char* replay_path = NULL;
+    bool replay_max_speed = false;
+    bool bench_network = false;
+    bool bench_parse = false;
+
+    for ( int i = 1; i < argc; i++ ) {
+        if ( strcmp( argv[i], "--trace" ) == 0 ) {
+            tracer.enabled = true;
+        } else if ( strcmp( argv[i], "--record" ) == 0 && i + 1 < argc ) {
+            record_path = argv[++i];
+        } else if ( strcmp( argv[i], "--replay" ) == 0 && i + 1 < argc ) {
+            replay_path = argv[++i];
+        } else if ( strcmp( argv[i], "--max-speed" ) == 0 ) {
+            replay_max_speed = true;
+        } else if ( strcmp( argv[i], "--bench-network" ) == 0 ) {
+            bench_network = true;
+        } else if ( strcmp( argv[i], "--bench-parse" ) == 0 ) {
+            bench_parse = true;
+        } else if ( strcmp( argv[i], "--metrics-file" ) == 0 && i + 1 < argc ) {
+            metrics_exporter.file_path = argv[++i];
+        } else if ( strcmp( argv[i], "--metrics-port" ) == 0 && i + 1 < argc ) {
+            metrics_exporter.http_port = atoi( argv[++i] );
+        } else if ( strcmp( argv[i], "--metrics-interval" ) == 0 && i + 1 < argc ) {
+            metrics_exporter.interval = atof( argv[++i] );
+        } else if ( strcmp( argv[i], "--presence-interval" ) == 0 && i + 1 < argc ) {
+            presence.interval = atof( argv[++i] );
+        } else if ( strcmp( argv[i], "--font" ) == 0 && i + 1 < argc ) {
+            font_path = argv[++i];
+        }
+    }
+
+    // Replays run headless and without Steam
+    if ( replay_path != NULL ) {
+        int result = CallbackReplayer::Run( replay_path, replay_max_speed );
+        if ( tracer.enabled ) {
+            tracer.Dump( TRACE_OUTPUT_PATH );
+        }
+        return result;
+    }
+
+    if ( bench_parse ) {
+        return RichTextParser::Benchmark();
+    }
+
+    // Needs Steam for the networking interfaces, but no window
+    if ( bench_network ) {
+        if ( !SteamAPI_Init() ) {
+            std::cout << "An instance of Steam needs to be running" << std::endl;
+            return EXIT_FAILURE;
+        }
+        int result = NetworkBenchmark::Run();
+        SteamAPI_Shutdown();
+        return result;
+    }
+
+    // This Starts the game in Steam
+    if ( SteamAPI_RestartAppIfNecessary( APP_ID ) ) {
+        return 1;
+    }
+
+    // The last session, if there's one, decides the window size and what's on screen at first
+    bool warm_start = session_snapshot.Open( SNAPSHOT_PATH );
+    int window_width = 800, window_height = 600;
+    session_snapshot.WindowSize( &window_width, &window_height );
+
+    InitWindow(window_width, window_height, "Steam Test");
+    SetWindowState(FLAG_WINDOW_RESIZABLE);
+
+    SetExitKey(0);
+
+    avatars.Load();
+
+    read_watermarks.Load( WATERMARKS_PATH );
+
+    if ( text_renderer.Load( font_path ) ) {
+        shaping_cache.Start();
+    } else {
+        TraceLog( LOG_WARNING, "Falling back to the default font, non ASCII text won't render" );
+    }
+
+    // Needs the avatar atlas and watermarks above, but nothing from Steam
+    uint64 rejoin_lobby = 0;
+    if ( warm_start ) {
+        rejoin_lobby = session_snapshot.Restore();
+        session_snapshot.Close();
+    }
+
+    if ( !SteamAPI_Init() ) {
+        std::cout << "An instance of Steam needs to be running" << std::endl;
+        return EXIT_FAILURE;
+    }
+    // Start measuring ping now, hosting and browsing both want the result
+    SteamNetworkingUtils()->InitRelayNetworkAccess();
+    diagnostics.Listen();
+
+    if ( record_path != NULL && !recorder.Open( record_path ) ) {
+        return EXIT_FAILURE;
+    }
+
+    if ( !metrics_exporter.Start() ) {
+        return EXIT_FAILURE;
+    }
+
+    screen_state = eScreenState::OUTSIDE_LOBBY;
+    if ( rejoin_lobby != 0 ) {
+        join_pipeline.Resume( rejoin_lobby );
+        lobby_manager.JoinLobby( rejoin_lobby );
+    }
+    Layout::BuildScreens();
+    SetTargetFPS(100);
+
+    while ( !WindowShouldClose() && !program.should_quit ) {
+        TRACE_SCOPE( "Frame", "frame" );
+
+        BeginDrawing();
+        DrawFPS(0, 0);
+        {
+            TRACE_SCOPE( "RunCallbacks", "frame" );
+            SteamAPI_RunCallbacks();
+        }
+        if ( screen_state == eScreenState::LOBBY ) {
+            TRACE_SCOPE( "Diagnostics", "frame" );
+            diagnostics.Poll();
+        }
+        session_manager.Update();
+        // Every screen, input in the browser or the other forms counts as activity too
+        presence.Update();
+        if ( screen_state == eScreenState::LOBBY ) {
+            join_pipeline.Update();
+            shard_manager.Update();
+        }
+        if ( tracer.enabled && IsKeyPressed( KEY_F9 ) ) {
+            tracer.Dump( TRACE_OUTPUT_PATH );
+        }
+        metrics.frame_us.Record( static_cast<uint64>( GetFrameTime() * 1e6 ) );
+        metrics_exporter.Update();
+        avatars.Update();
+        member_list.Update();
+        if ( screen_state == eScreenState::LOBBY_BROWSER ) {
+            lobby_browser.Update();
+        }
+        read_watermarks.SaveIfDirty( WATERMARKS_PATH );
+        lobby_manager.reassembler.Expire();
+        {
+            TRACE_SCOPE( "Layout", "frame" );
+            screen_layouts[screen_state].Update();
+        }
+        ClearBackground(RAYWHITE);
+        {
+            TRACE_SCOPE( "Render", "frame" );
+            // LOG( screen_state );
+            switch ( screen_state ) {
+                case eScreenState::LOADING:
+                    Screen::renderLoading();
+                    break;
+                case eScreenState::OUTSIDE_LOBBY:
+                    Screen::renderOutsideLobby();
+                    break;
+                case eScreenState::LOBBY_CREATION:
+                    Screen::renderLobbyCreation();
+                    break;
+                case eScreenState::LOBBY_JOIN:
+                    Screen::renderLobbyJoin();
+                    break;
+                case eScreenState::LOBBY:
+                    Screen::renderLobby();
+                    break;
+                case eScreenState::LOBBY_BROWSER:
+                    Screen::renderLobbyBrowser();
+                    break;
+            }
+        }
+
+        TRACE_SCOPE( "EndDrawing", "frame" );
+        EndDrawing();
+    }
+    SessionSnapshot::Save( SNAPSHOT_PATH );
+    session_manager.CloseAll();
+    read_watermarks.Save( WATERMARKS_PATH );
+    if ( tracer.enabled ) {
+        tracer.Dump( TRACE_OUTPUT_PATH );
+    }
+    recorder.Close();
+    metrics_exporter.Stop();
+    shaping_cache.Stop();
+    text_renderer.Unload();
+    avatars.Unload();
+    CloseWindow();
+    SteamAPI_Shutdown();
+}
+
+void Screen::renderLoading() {
+    Rectangle text = screen_layouts[eScreenState::LOADING].Get( W_LOADING_TEXT );
+    DrawText(program.loading_screen_text.c_str(), text.x, text.y, 32, BLACK);
+}
+
+void Screen::renderOutsideLobby() {
+    Layout& layout = screen_layouts[eScreenState::OUTSIDE_LOBBY];
+    if ( GuiButton( layout.Get( W_OUTSIDE_CREATE ), "Create Lobby" ) ) {
+        screen_state = eScreenState::LOBBY_CREATION;
+    }
+    if ( GuiButton( layout.Get( W_OUTSIDE_JOIN ), "Join Lobby" ) ) {
+        screen_state = eScreenState::LOBBY_JOIN;
+    }
+    if ( GuiButton( layout.Get( W_OUTSIDE_BROWSE ), "Browse Lobbies" ) ) {
+        screen_state = eScreenState::LOBBY_BROWSER;
+        lobby_browser.Refresh();
+    }
+    if ( GuiButton( layout.Get( W_OUTSIDE_QUIT ), "Quit" ) ) {
+        program.should_quit = true;
+    }
+    // Still in lobbies, after opening a new tab or a failed join
+    const std::vector<uint64>& tabs = session_manager.Tabs();
+    layout.SetVisible( W_OUTSIDE_BACK, !tabs.empty() );
+    if ( !tabs.empty() && GuiButton( layout.Get( W_OUTSIDE_BACK ), "Back to Lobbies" ) ) {
+        session_manager.Switch( lobby_manager.id ? lobby_manager.id : tabs.back() );
+    }
+}
+
+void Screen::renderLobbyCreation() {
+    Layout& layout = screen_layouts[eScreenState::LOBBY_CREATION];
+    Rectangle textbox_bounds = layout.Get( W_FORM_TEXTBOX );
+    Rectangle button_bounds = layout.Get( W_FORM_BUTTON );
+
+    if ( GuiTextBox( textbox_bounds, lobby_manager.lobby_name, 100, true ) || GuiButton( button_bounds, "Create Lobby" )) {
+        if ( strlen( lobby_manager.lobby_name ) > 6 ) {
+            screen_state = eScreenState::LOADING;
+            program.loading_screen_text = "Creating Lobby";
+
+            lobby_manager.CreateLobby();
+        }
+    }
+}
+
+void Screen::renderLobbyJoin() {
+    Layout& layout = screen_layouts[eScreenState::LOBBY_JOIN];
+    Rectangle textbox_bounds = layout.Get( W_FORM_TEXTBOX );
+    Rectangle button_bounds = layout.Get( W_FORM_BUTTON );
+
+    if ( GuiTextBox( textbox_bounds, lobby_manager.lobby_id_text_box, 100, true ) || GuiButton( button_bounds, "Join Lobby" )) {
+        if ( strlen( lobby_manager.lobby_id_text_box) > 0 ) {
+            shard_manager.JoinRoom(std::stoull(lobby_manager.lobby_id_text_box));
+        }
+    }
+}
+
+void Screen::renderLobby() {
+    Layout& layout = screen_layouts[eScreenState::LOBBY];
+    float font_height = 20;
+    join_pipeline.OnPaint();
+
+    // The chat box grows with its line count, the message list gives up the space
+    float chat_box_height = chat_input.Height( font_height / 2 );
+    layout.Resize( W_LOBBY_CHAT_BOX, 0, chat_box_height );
+    layout.SetVisible( W_LOBBY_DIAGNOSTICS, diagnostics.visible );
+
+    Rectangle members_panel = layout.Get( W_LOBBY_MEMBERS );
+    Rectangle chat_panel = layout.Get( W_LOBBY_CHAT );
+
+    GuiPanel( members_panel, TextFormat( "Online: %d", lobby_manager.members.size() ) );
+
+    // Type-ahead filter and the sort order toggle
+    if ( GuiTextBox( layout.Get( W_LOBBY_MEMBER_FILTER ), member_list.filter_text, sizeof( member_list.filter_text ), member_list.filter_edit ) ) {
+        member_list.filter_edit = !member_list.filter_edit;
+    }
+    member_list.SetFilter( member_list.filter_text );
+    bool by_name = member_list.Sort() == MemberList::SORT_NAME;
+    if ( GuiButton( layout.Get( W_LOBBY_MEMBER_SORT ), by_name ? "A-Z" : "Status" ) ) {
+        member_list.SetSort( by_name ? MemberList::SORT_STATUS : MemberList::SORT_NAME );
+    }
+    Screen::renderMemberList( layout.Get( W_LOBBY_MEMBER_LIST ), font_height, font_height / 2 );
+
+    // Until we're in, the header shows what's known of the lobby being joined
+    uint64 shown = lobby_manager.id ? lobby_manager.id : join_pipeline.Lobby();
+    const LobbyMetadata::Info& info = lobby_metadata.Get( shown );
+    if ( join_pipeline.Active() ) {
+        const char* name = info.name.empty() ? lobby_manager.lobby_name : info.name.c_str(); // as of the snapshot
+        GuiPanel( chat_panel, TextFormat( "%s Lobby: %s", name, join_pipeline.Status().c_str() ) );
+    } else {
+        GuiPanel( chat_panel, TextFormat( "%s Lobby: Owned by %s", info.name.c_str(), lobby_manager.lobby_leader.c_str() ) );
+    }
+
+    Screen::renderTabs( layout.Get( W_LOBBY_TABS ) );
+    Screen::renderMessageList( layout.Get( W_LOBBY_MESSAGE_LIST ), font_height, font_height / 2 );
+    Screen::renderTypingLine( layout.Get( W_LOBBY_TYPING ), font_height / 2 );
+
+    // Jump to a time, or to the first unread message
+    Rectangle jump_box = layout.Get( W_LOBBY_JUMP_BOX );
+    if ( GuiTextBox( jump_box, chat_view.jump_text, sizeof( chat_view.jump_text ), chat_view.jump_edit ) ) {
+        if ( chat_view.jump_edit ) {
+            int64 timestamp = ParseJumpTime( chat_view.jump_text );
+            if ( timestamp >= 0 ) {
+                size_t index = lobby_manager.time_index.LowerBound( lobby_manager.messages, timestamp );
+                chat_view.target = lobby_manager.RowOf( index ) * font_height;
+                chat_view.jump_text[0] = '\0';
+            }
+        }
+        chat_view.jump_edit = !chat_view.jump_edit;
+    }
+
+    size_t first_unread = lobby_manager.time_index.LowerBound( lobby_manager.messages, chat_view.unread_after + 1 );
+    if ( chat_view.unread_after >= 0 && first_unread < lobby_manager.messages.size() ) {
+        if ( GuiButton( layout.Get( W_LOBBY_UNREAD_BUTTON ), TextFormat( "Unread (%zu)", lobby_manager.messages.size() - first_unread ) ) ) {
+            chat_view.target = lobby_manager.RowOf( first_unread ) * font_height;
+        }
+    }
+
+    // End of the send -> receive -> render flow, once per message
+    if ( tracer.enabled ) {
+        if ( tracer.rendered_messages > lobby_manager.messages.size() ) {
+            tracer.rendered_messages = 0;
+        }
+        for ( ; tracer.rendered_messages < lobby_manager.messages.size(); tracer.rendered_messages++ ) {
+            const std::string& msg = lobby_manager.messages[tracer.rendered_messages].text;
+            tracer.Flow( "message", 'f', Tracer::FlowId( msg.c_str(), msg.size() ) );
+        }
+    }
+
+    Rectangle chat_box = layout.Get( W_LOBBY_CHAT_BOX );
+    chat_input.focused = !chat_view.jump_edit && !member_list.filter_edit;
+    // Typing works straight away, sending once the join is far enough along
+    if ( chat_input.Update( chat_box, font_height / 2 ) && chat_input.Size() > 0 && join_pipeline.Interactive() ) {
+        lobby_manager.SendMessage(SteamFriends()->GetPersonaName(), chat_input.Text());
+        chat_input.Clear();
+    }
+    if ( chat_input.focused ) {
+        chat_view.jump_edit = false; // clicked back into the chat box
+        member_list.filter_edit = false;
+    }
+
+    if ( IsKeyPressed( KEY_F3 ) ) {
+        diagnostics.visible = !diagnostics.visible;
+    }
+
+    if ( diagnostics.visible ) {
+        diagnostics.Render( layout.Get( W_LOBBY_DIAGNOSTICS ) );
+    }
+}
+
+void Screen::renderMessage( const ChatMessage& message, Vector2 position, float size, size_t from ) {
+    float x = position.x;
+    size_t limit = from + MESSAGE_PREVIEW_BYTES;
+    for ( const TextSpan& span : message.spans ) {
+        if ( span.end <= from ) {
+            continue;
+        }
+        if ( span.begin >= limit ) {
+            break;
+        }
+        size_t begin = span.begin > from ? span.begin : from;
+        const char* text = message.text.c_str() + begin;
+        size_t len = MIN( static_cast<size_t>( span.end ), limit ) - begin;
+
+        Color color = BLACK;
+        if ( span.style & (SPAN_MENTION | SPAN_LINK) ) color = BLUE;
+        else if ( span.style & SPAN_CODE ) color = MAROON;
+        else if ( span.style & SPAN_ITALIC ) color = DARKGRAY;
+
+        float width = text_renderer.Measure( text, len, size );
+        if ( span.style & SPAN_CODE ) {
+            DrawRectangle( x - 1, position.y - 1, width + 2, size + 2, LIGHTGRAY );
+        }
+
+        text_renderer.Queue( text, len, Vector2 { x, position.y }, size, color );
+        if ( span.style & SPAN_BOLD ) {
+            // No bold face in the atlas, a second pass half a pixel over thickens the strokes
+            text_renderer.Queue( text, len, Vector2 { x + 0.5f, position.y }, size, color );
+        }
+        if ( span.style & SPAN_STRIKE ) {
+            DrawLine( x, position.y + size / 2, x + width, position.y + size / 2, color );
+        }
+        if ( span.style & SPAN_LINK ) {
+            DrawLine( x, position.y + size, x + width, position.y + size, color );
+        }
+        x += width;
+    }
+    // Cut inside a span or between two, either way the row says so
+    if ( message.text.size() > limit ) {
+        text_renderer.Queue( TextFormat( " ... (%.1f KB)", message.text.size() / 1024.0f ), Vector2 { x, position.y }, size, GRAY );
+    }
+}
+
+// "alice, bob and 10 more joined", or with both kinds "alice and bob: 2 joined, 1 left"
+void Screen::renderMembershipRow( const MembershipRun& run, Vector2 position, float size ) {
+    uint32 events = run.joined + run.left;
+    std::string text;
+    for ( size_t i = 0; i < run.names.size(); i++ ) {
+        if ( i > 0 ) {
+            text += i + 1 == run.names.size() && events == run.names.size() ? " and " : ", ";
+        }
+        text += run.names[i];
+    }
+    if ( events > run.names.size() ) {
+        text += TextFormat( " and %u more", events - static_cast<uint32>( run.names.size() ) );
+    }
+
+    if ( run.left == 0 ) {
+        text += " joined";
+    } else if ( run.joined == 0 ) {
+        text += " left";
+    } else {
+        text += TextFormat( ": %u joined, %u left", run.joined, run.left );
+    }
+    text_renderer.Queue( text.c_str(), text.size(), position, size, GRAY );
+}
+
+void Screen::resetChatView() {
+    chat_view.scroll = 0;
+    chat_view.velocity = 0;
+    chat_view.target = -1;
+    chat_view.stick_to_bottom = true;
+    chat_view.unread_after = read_watermarks.Get( lobby_manager.id );
+}
+
+// Only the rows inside `bounds` are drawn. The wheel adds velocity that decays,
+// jumps ease towards their target, and the list follows new messages at the bottom
+void Screen::renderMessageList( Rectangle bounds, float row_height, float font_size ) {
+    const std::vector<ChatMessage>& messages = lobby_manager.messages;
+    float dt = GetFrameTime();
+    const std::vector<MessageRow>& rows = lobby_manager.rows;
+    float max_scroll = rows.size() * row_height - bounds.height;
+    max_scroll = max_scroll > 0 ? max_scroll : 0;
+
+    if ( screen_layouts[eScreenState::LOBBY].HitTest( GetMousePosition() ) == W_LOBBY_MESSAGE_LIST ) {
+        float wheel = GetMouseWheelMove();
+        if ( wheel != 0 ) {
+            chat_view.velocity -= wheel * row_height * 20;
+            chat_view.target = -1;
+        }
+    }
+
+    if ( chat_view.target >= 0 ) {
+        float target = chat_view.target < max_scroll ? chat_view.target : max_scroll;
+        chat_view.scroll += (target - chat_view.scroll) * MIN( 1.0f, dt * 12 );
+        chat_view.velocity = 0;
+        if ( fabsf( target - chat_view.scroll ) < 0.5f ) {
+            chat_view.scroll = target;
+            chat_view.target = -1;
+        }
+    } else if ( chat_view.stick_to_bottom && chat_view.velocity == 0 ) {
+        chat_view.scroll = max_scroll;
+    } else {
+        chat_view.scroll += chat_view.velocity * dt;
+        chat_view.velocity *= expf( -dt * 6 );
+        if ( fabsf( chat_view.velocity ) < 1 ) {
+            chat_view.velocity = 0;
+        }
+    }
+
+    if ( chat_view.scroll < 0 || chat_view.scroll > max_scroll ) {
+        chat_view.scroll = chat_view.scroll < 0 ? 0 : max_scroll;
+        chat_view.velocity = 0;
+    }
+    chat_view.stick_to_bottom = chat_view.target < 0 && chat_view.scroll >= max_scroll - 1;
+
+    size_t first = static_cast<size_t>( chat_view.scroll / row_height );
+    size_t last = MIN( rows.size(), first + static_cast<size_t>( bounds.height / row_height ) + 2 );
+    size_t unread_row = chat_view.unread_after >= 0
+        ? lobby_manager.RowOf( lobby_manager.time_index.LowerBound( messages, chat_view.unread_after + 1 ) ) : rows.size();
+
+    BeginScissorMode( bounds.x, bounds.y, bounds.width, bounds.height );
+    float time_width = 40;
+    for ( size_t i = first; i < last; i++ ) {
+        const MessageRow& row = rows[i];
+        float y = bounds.y + i * row_height - chat_view.scroll;
+        Vector2 body_position = { bounds.x + time_width, y };
+
+        if ( i == unread_row && i > 0 ) {
+            DrawLine( bounds.x, y - 2, bounds.x + bounds.width, y - 2, RED );
+        }
+
+        // Continued rows belong to the group above, only its first row gets the time and name
+        if ( row.kind == ROW_CONTINUED ) {
+            Screen::renderMessage( messages[row.index], body_position, font_size, messages[row.index].body );
+            continue;
+        }
+
+        int64 timestamp = row.kind == ROW_MEMBERSHIP
+            ? lobby_manager.membership_runs[row.index].first_time : messages[row.index].timestamp;
+        time_t seconds = static_cast<time_t>( timestamp / 1000 );
+        char time_text[8];
+        strftime( time_text, sizeof( time_text ), "%H:%M", localtime( &seconds ) );
+        text_renderer.Queue( time_text, Vector2 { bounds.x, y }, font_size, GRAY );
+        if ( row.kind == ROW_MEMBERSHIP ) {
+            Screen::renderMembershipRow( lobby_manager.membership_runs[row.index], body_position, font_size );
+        } else {
+            Screen::renderMessage( messages[row.index], body_position, font_size );
+        }
+    }
+
+    // All the names and messages go out as a single batch
+    text_renderer.Flush();
+    EndScissorMode();
+
+    // Whatever is on screen now counts as read
+    if ( last > first && lobby_manager.id != 0 ) {
+        const MessageRow& row = rows[last - 1];
+        read_watermarks.Advance( lobby_manager.id, row.kind == ROW_MEMBERSHIP
+            ? lobby_manager.membership_runs[row.index].last_time : messages[row.index].timestamp );
+    }
+}
+
+void Screen::renderLobbyBrowser() {
+    Layout& layout = screen_layouts[eScreenState::LOBBY_BROWSER];
+
+    if ( GuiButton( layout.Get( W_BROWSER_BACK ), "Back" ) ) {
+        screen_state = eScreenState::OUTSIDE_LOBBY;
+        return;
+    }
+    if ( GuiTextBox( layout.Get( W_BROWSER_FILTER ), lobby_browser.filter_text, sizeof( lobby_browser.filter_text ), lobby_browser.filter_edit ) ) {
+        lobby_browser.filter_edit = !lobby_browser.filter_edit;
+    }
+    lobby_browser.SetFilter( lobby_browser.filter_text );
+
+    bool free_slots_only = lobby_browser.free_slots_only;
+    GuiCheckBox( layout.Get( W_BROWSER_FREE_SLOTS ), "Free slots only", &free_slots_only );
+    lobby_browser.SetFreeSlotsOnly( free_slots_only );
+
+    if ( GuiButton( layout.Get( W_BROWSER_REFRESH ), lobby_browser.Busy() ? "Refreshing..." : "Refresh" ) ) {
+        lobby_browser.Refresh();
+    }
+
+    // One page of rows, sized by however many fit the list
+    const float row_height = 24;
+    const float font_size = 12;
+    Rectangle list = layout.Get( W_BROWSER_LIST );
+    const std::vector<const LobbyBrowser::Entry*>& visible = lobby_browser.Visible();
+    int page_size = static_cast<int>( list.height / row_height );
+    page_size = page_size > 0 ? page_size : 1;
+    int pages = static_cast<int>( (visible.size() + page_size - 1) / page_size );
+    lobby_browser.page = lobby_browser.page < pages ? lobby_browser.page : (pages > 0 ? pages - 1 : 0);
+
+    GuiPanel( list, NULL );
+    Vector2 mouse = GetMousePosition();
+    size_t first = static_cast<size_t>( lobby_browser.page ) * page_size;
+    for ( size_t i = first; i < visible.size() && i < first + page_size; i++ ) {
+        Rectangle row = { list.x, list.y + (i - first) * row_height, list.width, row_height };
+        if ( CheckCollisionPointRec( mouse, row ) ) {
+            DrawRectangleRec( row, LIGHTGRAY );
+            lobby_prefetcher.Prefetch( visible[i]->id );
+            if ( IsMouseButtonPressed( MOUSE_BUTTON_LEFT ) ) {
+                shard_manager.JoinRoom( visible[i]->id );
+            }
+        }
+        const std::string& label = visible[i]->label;
+        text_renderer.Queue( label.c_str(), label.size(), Vector2 { row.x + 8, row.y + (row_height - font_size) / 2 }, font_size, BLACK );
+    }
+    text_renderer.Flush();
+
+    if ( GuiButton( layout.Get( W_BROWSER_PREV ), "< Prev" ) && lobby_browser.page > 0 ) {
+        lobby_browser.page--;
+    }
+    if ( GuiButton( layout.Get( W_BROWSER_NEXT ), "Next >" ) && lobby_browser.page + 1 < pages ) {
+        lobby_browser.page++;
+    }
+
+    std::string status;
+    if ( lobby_browser.last_refresh < 0 ) {
+        status = lobby_browser.Busy() ? "Looking for lobbies..." : "No results yet";
+    } else {
+        status = TextFormat( "Page %d/%d, %zu lobbies. Last refresh %.0fs ago: %u new, %u changed, %u gone",
+                             lobby_browser.page + 1, pages > 0 ? pages : 1, visible.size(), GetTime() - lobby_browser.last_refresh,
+                             lobby_browser.added, lobby_browser.changed, lobby_browser.removed );
+    }
+    GuiLabel( layout.Get( W_BROWSER_STATUS ), status.c_str() );
+}
+
+// Same idea as the message list without the inertia: only the rows in view are drawn
+void Screen::renderMemberList( Rectangle bounds, float row_height, float font_size ) {
+    const std::vector<uint64>& visible = member_list.Visible();
+    float max_scroll = visible.size() * row_height - bounds.height;
+    max_scroll = max_scroll > 0 ? max_scroll : 0;
+
+    if ( screen_layouts[eScreenState::LOBBY].HitTest( GetMousePosition() ) == W_LOBBY_MEMBER_LIST ) {
+        member_list.scroll -= GetMouseWheelMove() * row_height * 3;
+    }
+    member_list.scroll = member_list.scroll < 0 ? 0 : MIN( member_list.scroll, max_scroll );
+
+    size_t first = static_cast<size_t>( member_list.scroll / row_height );
+    size_t last = MIN( visible.size(), first + static_cast<size_t>( bounds.height / row_height ) + 2 );
+    float avatar_size = row_height - 4;
+
+    BeginScissorMode( bounds.x, bounds.y - 3, bounds.width, bounds.height + 3 );
+    for ( size_t i = first; i < last; i++ ) {
+        float y = bounds.y + i * row_height - member_list.scroll;
+        avatars.Draw( visible[i], Rectangle { bounds.x, y - 3, avatar_size, avatar_size } );
+        const std::string& name = member_list.Name( visible[i] );
+        text_renderer.Queue( name.c_str(), name.size(), Vector2 { bounds.x + avatar_size + 4, y }, font_size,
+                             member_list.Away( visible[i] ) || presence.Idle( visible[i] ) ? GRAY : BLACK );
+        if ( presence.Typing( visible[i] ) ) {
+            text_renderer.Queue( "...", 3, Vector2 { bounds.x + bounds.width - 16, y }, font_size, GRAY );
+        }
+    }
+    text_renderer.Flush();
+    EndScissorMode();
+}
+
+// One tab per lobby, background ones with their unread count. The shown tab
+// gets a close button, "+" goes back out to join or create another
+void Screen::renderTabs( Rectangle bounds ) {
+    float x = bounds.x;
+    uint64 close = 0;
+    for ( uint64 lobby : session_manager.Tabs() ) {
+        bool shown = lobby == lobby_manager.id;
+        float width = shown ? 144 : 120;
+        if ( x + width + 28 > bounds.x + bounds.width ) {
+            break; // the rest stay reachable through their invites or the browser
+        }
+
+        const std::string& name = lobby_metadata.Get( lobby ).name;
+        size_t unread = session_manager.Unread( lobby );
+        const char* label = unread > 0 ? TextFormat( "%.10s (%zu)", name.c_str(), unread ) : TextFormat( "%.14s", name.c_str() );
+        bool active = shown;
+        GuiToggle( Rectangle { x, bounds.y, shown ? width - 24 : width, bounds.height }, label, &active );
+        if ( active && !shown ) {
+            session_manager.Switch( lobby );
+        }
+        if ( shown && GuiButton( Rectangle { x + width - 22, bounds.y, 22, bounds.height }, "x" ) ) {
+            close = lobby;
+        }
+        x += width + 4;
+    }
+    if ( GuiButton( Rectangle { x, bounds.y, 24, bounds.height }, "+" ) && !join_pipeline.Active() ) {
+        screen_state = eScreenState::OUTSIDE_LOBBY;
+    }
+
+    // Not while iterating the tabs
+    if ( close != 0 ) {
+        session_manager.Close( close );
+    }
+}
+
+void Screen::renderTypingLine( Rectangle bounds, float font_size ) {
+    const std::vector<uint64>& typing = presence.TypingMembers();
+    std::string text;
+    if ( typing.size() == 1 ) {
+        text = member_list.Name( typing[0] ) + " is typing...";
+    } else if ( typing.size() == 2 ) {
+        text = member_list.Name( typing[0] ) + " and " + member_list.Name( typing[1] ) + " are typing...";
+    } else if ( typing.size() > 2 ) {
+        text = TextFormat( "%zu people are typing...", typing.size() );
+    } else {
+        return;
+    }
+    text_renderer.Queue( text.c_str(), text.size(), Vector2 { bounds.x, bounds.y }, font_size, GRAY );
+    text_renderer.Flush();
+}
+
+int64 ParseJumpTime( const char* text ) {
+    time_t now = time( NULL );
+    std::tm tm = *localtime( &now );
+    int hour, minute, year, month, day;
+
+    if ( sscanf( text, "%d-%d-%d %d:%d", &year, &month, &day, &hour, &minute ) == 5 ) {
+        tm.tm_year = year - 1900;
+        tm.tm_mon = month - 1;
+        tm.tm_mday = day;
+    } else if ( sscanf( text, "yesterday %d:%d", &hour, &minute ) == 2 ) {
+        tm.tm_mday -= 1; // mktime normalizes the first of the month
+    } else if ( sscanf( text, "%d:%d", &hour, &minute ) != 2 ) {
+        return -1;
+    }
+
+    tm.tm_hour = hour;
+    tm.tm_min = minute;
+    tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    time_t result = mktime( &tm );
+    return result < 0 ? -1 : static_cast<int64>( result ) * 1000;
+}
+
+// Lobby Manager Implementation
+
+void LobbyManager::SendMessage( std::string sender, std::string msg ) {
+    // Not TextFormat, its buffer would cut long messages short
+    std::string full_msg = "[" + sender + "]: " + msg;
+    TraceLog( LOG_INFO, "%.*s : %d", MIN( (int) full_msg.size(), 200 ), full_msg.c_str(), msg.size() );
+
+    if ( tracer.enabled ) {
+        tracer.Flow( "message", 's', Tracer::FlowId( full_msg.c_str(), full_msg.size() ) );
+    }
+
+    // Fits in one lobby chat entry with room for a relay header, and can't be mistaken for a part
+    if ( full_msg.size() <= CHAT_ENTRY_BUDGET && !MessageReassembler::IsPart( full_msg.c_str(), full_msg.size() )
+         && !ShardManager::IsRelay( full_msg.c_str(), full_msg.size() ) ) {
+        if ( SteamMatchmaking()->SendLobbyChatMsg( lobby_manager.id, full_msg.c_str(), full_msg.size() ) ) {
+            metrics.messages_sent.Add();
+            metrics.bytes_sent.Add( full_msg.size() );
+        } else {
+            metrics.send_failures.Add();
+        }
+        return;
+    }
+
+    const size_t part_size = CHAT_ENTRY_BUDGET - MULTIPART_HEADER_SIZE;
+    size_t count = (full_msg.size() + part_size - 1) / part_size;
+    if ( count > MULTIPART_MAX_PARTS ) {
+        TraceLog( LOG_WARNING, "Message is too long to send (%zu bytes, at most %d)", full_msg.size(), MULTIPART_MAX_PARTS * (int) part_size );
+        metrics.send_failures.Add();
+        return;
+    }
+
+    uint32 message_id = next_message_id++;
+    char part[MAX_CHATMSG_SIZE];
+    memcpy( part, MULTIPART_MAGIC, 3 );
+    for ( size_t i = 0; i < count; i++ ) {
+        for ( int b = 0; b < 4; b++ ) part[3 + b] = static_cast<char>( message_id >> (8 * b) );
+        part[7] = static_cast<char>( i ); part[8] = static_cast<char>( i >> 8 );
+        part[9] = static_cast<char>( count ); part[10] = static_cast<char>( count >> 8 );
+
+        size_t len = MIN( part_size, full_msg.size() - i * part_size );
+        memcpy( part + MULTIPART_HEADER_SIZE, full_msg.data() + i * part_size, len );
+        if ( SteamMatchmaking()->SendLobbyChatMsg( lobby_manager.id, part, MULTIPART_HEADER_SIZE + len ) ) {
+            metrics.messages_sent.Add();
+            metrics.bytes_sent.Add( MULTIPART_HEADER_SIZE + len );
+        } else {
+            metrics.send_failures.Add();
+        }
+    }
+}
+
+void LobbyManager::CreateLobby() {
+    session_manager.Park();
+    SteamAPICall_t hSteamAPICall = SteamMatchmaking()->CreateLobby( k_ELobbyTypePublic, LOBBY_MAX_MEMBERS );
+    m_LobbyCreateCallResult.Set( hSteamAPICall, this, &LobbyManager::OnLobbyCreate );
+}
+
+void LobbyManager::OnLobbyCreate( LobbyCreated_t *pCallback, bool bIOFailure ) {
+    TRACE_SCOPE( "OnLobbyCreate", "callback" );
+    HistogramTimer timer( metrics.callback_us );
+
+    if ( bIOFailure ) {
+        LOG( "[INTERNAL ERROR] Couldn't Create Server" );
+    }
+
+    bool failed = true;
+    switch ( pCallback->m_eResult ) {
+        case k_EResultFail:
+            TraceLog( LOG_ERROR, "The server responded, but with an unknown internal error." );
+            break;
+        case k_EResultTimeout:
+            TraceLog( LOG_ERROR, "The message was sent to the Steam servers, but it didn't respond." );
+            break;
+        case k_EResultLimitExceeded:
+            TraceLog( LOG_ERROR, "Your game client has created too many lobbies and is being rate limited." );
+            break;
+        case k_EResultAccessDenied:
+            TraceLog( LOG_ERROR, "Your game isn't set to allow lobbies, or your client does haven't rights to play the game" );
+            break;
+        case k_EResultNoConnection:
+            TraceLog( LOG_ERROR, "Your Steam client doesn't have a connection to the back-end." );
+            break;
+        case k_EResultOK:
+            TraceLog(LOG_INFO, "Created Lobby Succesfully. Lobby ID: %lld", pCallback->m_ulSteamIDLobby);
+            failed = false;
+            break;
+        default:
+            TraceLog(LOG_ERROR, "Shouldn't be reachable");
+            return;
+    }
+
+    if ( failed ) {
+        screen_state = eScreenState::OUTSIDE_LOBBY;
+        return;
+    }
+
+    lobby_manager.id = pCallback->m_ulSteamIDLobby;
+    session_manager.Opened();
+    Screen::resetChatView();
+    if ( !SteamMatchmaking()->SetLobbyData( (CSteamID) lobby_manager.id, "lobby_name", std::string( lobby_manager.lobby_name ).c_str() ) ) {
+        TraceLog(LOG_ERROR, "Invalid Lobby ID");
+    }
+
+    // First member in the lobby
+    lobby_manager.members.push_back( SteamUser()->GetSteamID().ConvertToUint64() );
+    member_list.Reset( lobby_manager.members );
+    presence.Reset( lobby_manager.id, lobby_manager.members );
+    lobby_manager.owner = lobby_manager.members.back();
+    lobby_manager.roster_dirty = true;
+    lobby_manager.lobby_leader = SteamFriends()->GetPersonaName();
+
+    if ( !SteamMatchmaking()->SetLobbyData( lobby_manager.id, "lobby_leader", lobby_manager.lobby_leader.c_str() ) ) {
+        TraceLog(LOG_ERROR, "Invalid Lobby ID");
+    }
+
+    // What the lobby browser filters and ranks on
+    SteamMatchmaking()->SetLobbyData( lobby_manager.id, "app", LOBBY_APP_TAG );
+    SteamMatchmaking()->SetLobbyData( lobby_manager.id, "version", TextFormat( "%d", LOBBY_PROTOCOL_VERSION ) );
+    SteamMatchmaking()->SetLobbyData( lobby_manager.id, "room", TextFormat( "%llu", lobby_manager.id ) );
+    SteamMatchmaking()->SetLobbyData( lobby_manager.id, "shard", "0" );
+    lobby_manager.ping_location_published = false;
+    lobby_manager.PublishPingLocation();
+
+    screen_state = eScreenState::LOBBY;
+
+    SetClipboardText( TextFormat( "%lld", lobby_manager.id ) );
+}
+
+bool LocalPingLocation( char* text, int size ) {
+    SteamNetworkPingLocation_t location;
+    if ( SteamNetworkingUtils()->GetLocalPingLocation( location ) < 0 ) {
+        return false; // not measured yet
+    }
+    SteamNetworkingUtils()->ConvertPingLocationToString( location, text, size );
+    return true;
+}
+
+void LobbySession::PublishPingLocation() {
+    char text[k_cchMaxSteamNetworkingPingLocationString];
+    if ( LocalPingLocation( text, sizeof( text ) ) ) {
+        ping_location_published = SteamMatchmaking()->SetLobbyData( id, "ping_location", text );
+    }
+}
+
+void LobbySession::PublishRoster() {
+    if ( SteamMatchmaking()->GetLobbyOwner( id ) != SteamUser()->GetSteamID() ) {
+        roster_dirty = false; // the owner keeps it up to date
+        return;
+    }
+
+    std::string roster;
+    for ( size_t i = 0; i < members.size() && i < ROSTER_MAX_MEMBERS; i++ ) {
+        roster += TextFormat( i ? " %llx" : "%llx", members[i] );
+    }
+    SteamMatchmaking()->SetLobbyData( id, "roster", roster.c_str() );
+    SteamMatchmaking()->SetLobbyData( id, "successor", TextFormat( "%llu", Successor() ) );
+    roster_dirty = false;
+    roster_published = GetTime();
+}
+
+uint64 LobbySession::Successor() const {
+    uint64 best = 0;
+    bool best_idle = true;
+    for ( uint64 member : members ) {
+        if ( member == owner ) {
+            continue;
+        }
+        // Presence only holds the displayed lobby, a parked one's member data is read directly
+        bool idle;
+        if ( Foreground() ) {
+            idle = presence.Idle( member );
+        } else {
+            const char* value = SteamMatchmaking()->GetLobbyMemberData( id, member, "presence" );
+            idle = value != NULL && (atoi( value ) & PRESENCE_IDLE) != 0;
+        }
+        if ( best == 0 || idle < best_idle || (idle == best_idle && member < best) ) {
+            best = member;
+            best_idle = idle;
+        }
+    }
+    return best;
+}
+
+void LobbySession::CheckOwner() {
+    uint64 current = SteamMatchmaking()->GetLobbyOwner( id ).ConvertToUint64();
+    if ( current == 0 || current == owner ) {
+        return;
+    }
+    uint64 previous = owner;
+    owner = current;
+    if ( previous == 0 ) {
+        return; // first look after entering
+    }
+
+    lobby_leader = SteamFriends()->GetFriendPersonaName( current );
+    metrics.owner_migrations.Add();
+    TraceLog( LOG_INFO, "Lobby %llu passed from %llu to %llu", id, previous, current );
+    std::string notice = "[SERVER]: " + lobby_leader + " now owns the lobby";
+    AppendMessage( notice.data(), notice.size() );
+    if ( current != SteamUser()->GetSteamID().ConvertToUint64() ) {
+        return;
+    }
+
+    // The owner dropped without handing over and Steam picked us, but the election says otherwise
+    uint64 successor = lobby_metadata.Refresh( id ).successor;
+    if ( successor != 0 && successor != current && std::find( members.begin(), members.end(), successor ) != members.end() ) {
+        SteamMatchmaking()->SetLobbyOwner( id, successor );
+        return;
+    }
+
+    // Everything the owner keeps up goes out again now rather than on its next interval
+    SteamMatchmaking()->SetLobbyData( id, "lobby_leader", lobby_leader.c_str() );
+    roster_dirty = true;
+    roster_published = -1;
+    ping_location_published = false;
+    shard_manager.Recheck();
+}
+
+void LobbyManager::JoinLobby(uint64 SteamID) {
+    if ( session_manager.Switch( SteamID ) ) {
+        return; // already in it, in another tab
+    }
+    session_manager.Park();
+    join_pipeline.Target( SteamID );
+    SteamAPICall_t hSteamAPICall = SteamMatchmaking()->JoinLobby(SteamID);
+    m_LobbyJoinCallResult.Set( hSteamAPICall, this, &LobbyManager::OnLobbyJoin );
+}
+
+void LobbyManager::reFillMembersVector() {
+    lobby_manager.members.clear();
+    int nMembers = SteamMatchmaking()->GetNumLobbyMembers( lobby_manager.id );
+    for (int i = 0; i < nMembers; i++) {
+        lobby_manager.members.push_back( SteamMatchmaking()->GetLobbyMemberByIndex( lobby_manager.id, i ).ConvertToUint64() );
+    }
+    member_list.Reset( lobby_manager.members );
+    lobby_manager.roster_dirty = true;
+}
+
+void LobbyManager::OnLobbyJoin( LobbyEnter_t *pCallback, bool bIOFailure ) {
+    TRACE_SCOPE( "OnLobbyJoin", "callback" );
+    HistogramTimer timer( metrics.callback_us );
+    if ( bIOFailure || pCallback->m_EChatRoomEnterResponse != k_EChatRoomEnterResponseSuccess ) {
+        TraceLog(LOG_ERROR, "Couldn't Join Lobby");
+        join_pipeline.Fail();
+        screen_state = eScreenState::OUTSIDE_LOBBY;
+        return;
+    }
+
+    lobby_manager.id = pCallback->m_ulSteamIDLobby;
+    session_manager.Opened();
+    lobby_manager.ping_location_published = true; // the host's location is the one that counts
+    const LobbyMetadata::Info& info = lobby_metadata.Refresh( lobby_manager.id );
+    lobby_manager.lobby_leader = info.leader;
+    strncpy( lobby_manager.lobby_name, info.name.c_str(), sizeof( lobby_manager.lobby_name ) - 1 );
+    owner = 0;
+    CheckOwner();
+
+    reFillMembersVector();
+    // History restored from the session snapshot stays, there's nothing to backfill it from
+    if ( history_lobby != id ) {
+        messages.clear();
+        rows.clear();
+        membership_runs.clear();
+        time_index.Clear();
+        Screen::resetChatView();
+        history_lobby = id;
+    }
+    reassembler.Clear();
+    presence.Reset( id, members );
+    join_pipeline.OnEntered( members );
+
+    TraceLog(LOG_INFO, "Joined Lobby %lld", lobby_manager.id);
+    SendMessage("SERVER", TextFormat("%s has Joined the lobby", SteamFriends()->GetPersonaName()));
+    screen_state = eScreenState::LOBBY;
+}
+
+void LobbyManager::LeaveLobby() {
+    if (id == 0) {
+        TraceLog(LOG_WARNING, "Not Connected to Any Lobby");
+        return;
+    }
+    SendMessage("SERVER", TextFormat("%s has Left the lobby", SteamFriends()->GetPersonaName()));
+    if ( shard_manager.Home() == id ) {
+        shard_manager.LeaveAll();
+    }
+    Leave();
+    static_cast<LobbySession&>( *this ) = LobbySession {};
+    presence.Reset( 0, {} );
+    member_list.Clear();
+    diagnostics.Clear();
+}
+
+void LobbySession::Leave() {
+    // Handing over first means the lobby never sits without an owner, or with Steam's pick
+    if ( owner == SteamUser()->GetSteamID().ConvertToUint64() ) {
+        uint64 successor = Successor();
+        if ( successor != 0 ) {
+            // Published too, or the new owner would hand on to an older election
+            SteamMatchmaking()->SetLobbyData( id, "successor", TextFormat( "%llu", successor ) );
+            SteamMatchmaking()->SetLobbyOwner( id, successor );
+        }
+    }
+    SteamMatchmaking()->LeaveLobby( id );
+}
+
+bool LobbySession::Foreground() const {
+    return this == &lobby_manager;
+}
+
+void LobbySession::HandleMemberChange( uint64 member, uint32 state_change ) {
+    auto it = std::find( members.begin(), members.end(), member );
+    roster_dirty = true;
+    if ( state_change & k_EChatMemberStateChangeEntered ) {
+        if ( it == members.end() ) {
+            members.push_back( member );
+            if ( Foreground() ) {
+                member_list.Add( member );
+            }
+        }
+        return;
+    }
+
+    // Left, disconnected, kicked or banned
+    if ( it != members.end() ) {
+        members.erase( it );
+        if ( Foreground() ) {
+            member_list.Remove( member );
+            presence.Forget( member );
+        }
+        if ( !session_manager.Shares( member ) ) {
+            avatars.Forget( member );
+        }
+    }
+}
+
+void LobbySession::HandleChatEntry( uint64 sender, const char* data, int size ) {
+    metrics.bytes_received.Add( size );
+
+    // From another shard of the room, unless it's our own shard's message coming back around
+    if ( ShardManager::IsRelay( data, size ) ) {
+        ShardManager::Envelope envelope = ShardManager::Unwrap( data );
+        if ( envelope.origin_lobby == id || !shard_manager.FirstSighting( envelope ) ) {
+            return;
+        }
+        sender = envelope.sender;
+        data += RELAY_HEADER_SIZE;
+        size -= RELAY_HEADER_SIZE;
+    }
+
+    if ( MessageReassembler::IsPart( data, size ) ) {
+        std::string text;
+        if ( reassembler.Add( sender, data, size, text ) ) {
+            AppendMessage( text.data(), text.size() );
+        }
+        return;
+    }
+
+    AppendMessage( data, strnlen( data, size ) );
+}
+
+void LobbySession::AppendMessage( const char* data, size_t size ) {
+    if ( tracer.enabled ) {
+        tracer.Flow( "message", 't', Tracer::FlowId( data, size ) );
+    }
+    metrics.messages_received.Add();
+    AppendMessage( data, size, std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::system_clock::now().time_since_epoch() ).count() );
+}
+
+void LobbySession::AppendRun( MembershipRun run ) {
+    rows.push_back( MessageRow { static_cast<uint32>( membership_runs.size() ), ROW_MEMBERSHIP } );
+    membership_runs.push_back( std::move( run ) );
+}
+
+void LobbySession::AppendMessage( const char* data, size_t size, int64 now ) {
+
+    // Join and leave notices only extend the current run, or start one
+    std::string name;
+    eMembershipNotice notice = ParseMembershipNotice( data, size, &name );
+    if ( notice != NOTICE_NONE ) {
+        bool extend = !rows.empty() && rows.back().kind == ROW_MEMBERSHIP
+            && now - membership_runs.back().last_time < MESSAGE_GROUP_WINDOW_MS;
+        if ( !extend ) {
+            rows.push_back( MessageRow { static_cast<uint32>( membership_runs.size() ), ROW_MEMBERSHIP } );
+            membership_runs.emplace_back();
+            membership_runs.back().first_time = now;
+        }
+        MembershipRun& run = membership_runs.back();
+        run.last_time = now > run.last_time ? now : run.last_time;
+        ( notice == NOTICE_JOINED ? run.joined : run.left )++;
+        if ( run.names.size() < 3 && std::find( run.names.begin(), run.names.end(), name ) == run.names.end() ) {
+            run.names.push_back( std::move( name ) );
+        }
+        return;
+    }
+
+    ChatMessage message;
+    message.text.assign( data, size );
+    message.timestamp = messages.empty() || now > messages.back().timestamp ? now : messages.back().timestamp;
+    size_t prefix_end = message.text.compare( 0, 1, "[" ) == 0 ? message.text.find( "]: " ) : std::string::npos;
+    message.body = prefix_end < MESSAGE_PREFIX_MAX_BYTES ? static_cast<uint16>( prefix_end + 3 ) : 0;
+    RichTextParser::Parse( message.text, message.spans );
+
+    // Same sender when the prefixes, brackets included, are byte for byte equal
+    MessageRow row = { static_cast<uint32>( messages.size() ), ROW_MESSAGE };
+    if ( !rows.empty() && rows.back().kind != ROW_MEMBERSHIP && message.body > 0 ) {
+        const ChatMessage& above = messages.back();
+        if ( message.timestamp - above.timestamp < MESSAGE_GROUP_WINDOW_MS && above.body == message.body
+            && above.text.compare( 0, above.body, message.text, 0, message.body ) == 0 ) {
+            row.kind = ROW_CONTINUED;
+        }
+    }
+    rows.push_back( row );
+
+    // Exactly the slices renderMessage asks for, so drawing only ever replays cached runs
+    if ( Foreground() ) {
+        size_t from = row.kind == ROW_CONTINUED ? message.body : 0;
+        size_t limit = from + MESSAGE_PREVIEW_BYTES;
+        for ( const TextSpan& span : message.spans ) {
+            if ( span.end <= from ) {
+                continue;
+            }
+            if ( span.begin >= limit ) {
+                break;
+            }
+            size_t begin = span.begin > from ? span.begin : from;
+            shaping_cache.Prefetch( message.text.substr( begin, MIN( static_cast<size_t>( span.end ), limit ) - begin ) );
+        }
+        if ( message.text.size() > limit ) {
+            shaping_cache.Prefetch( TextFormat( " ... (%.1f KB)", message.text.size() / 1024.0f ) );
+        }
+    }
+
+    message.row = static_cast<uint32>( rows.size() - 1 );
+    messages.push_back( std::move( message ) );
+    time_index.Append( messages );
+
+    if ( Foreground() ) {
+        metrics.history_size.Set( messages.size() );
+    }
+}
+
+eMembershipNotice ParseMembershipNotice( const char* text, size_t size, std::string* name ) {
+    static const std::string prefix = "[SERVER]: ";
+    static const std::string joined = " has Joined the lobby";
+    static const std::string left = " has Left the lobby";
+
+    if ( size <= prefix.size() || prefix.compare( 0, prefix.size(), text, prefix.size() ) != 0 ) {
+        return NOTICE_NONE;
+    }
+    for ( const std::string* suffix : { &joined, &left } ) {
+        if ( size > prefix.size() + suffix->size()
+            && suffix->compare( 0, suffix->size(), text + size - suffix->size(), suffix->size() ) == 0 ) {
+            name->assign( text + prefix.size(), size - prefix.size() - suffix->size() );
+            return suffix == &joined ? NOTICE_JOINED : NOTICE_LEFT;
+        }
+    }
+    return NOTICE_NONE;
+}
+
+// Session Manager Implementation
+
+LobbySession* SessionManager::Find( uint64 lobby ) const {
+    auto it = routes.find( lobby );
+    return it != routes.end() ? it->second : NULL;
+}
+
+void SessionManager::Opened() {
+    parked.erase( lobby_manager.id ); // rejoined a shard that was open in another tab
+    routes[lobby_manager.id] = &lobby_manager;
+    if ( std::find( tabs.begin(), tabs.end(), lobby_manager.id ) == tabs.end() ) {
+        tabs.push_back( lobby_manager.id );
+    }
+}
+
+void SessionManager::Park() {
+    if ( lobby_manager.id == 0 ) {
+        return;
+    }
+    lobby_manager.parked_scroll = chat_view.scroll;
+    lobby_manager.parked_at_bottom = chat_view.stick_to_bottom;
+
+    LobbySession& displayed = lobby_manager;
+    std::unique_ptr<LobbySession> session = std::make_unique<LobbySession>( std::move( displayed ) );
+    displayed = LobbySession {};
+    routes[session->id] = session.get();
+    parked[session->id] = std::move( session );
+
+    member_list.Clear();
+    presence.Reset( 0, {} );
+    diagnostics.Clear();
+}
+
+bool SessionManager::Switch( uint64 lobby ) {
+    if ( lobby != 0 && lobby == lobby_manager.id ) {
+        screen_state = eScreenState::LOBBY;
+        return true;
+    }
+    auto it = parked.find( lobby );
+    if ( it == parked.end() || join_pipeline.Active() ) {
+        return false;
+    }
+    std::unique_ptr<LobbySession> session = std::move( it->second );
+    parked.erase( it );
+
+    Park();
+    static_cast<LobbySession&>( lobby_manager ) = std::move( *session );
+    routes[lobby] = &lobby_manager;
+    Activate();
+    return true;
+}
+
+// Rebuilds what only the displayed lobby has
+void SessionManager::Activate() {
+    member_list.Reset( lobby_manager.members );
+    presence.Reset( lobby_manager.id, lobby_manager.members );
+    chat_view.scroll = lobby_manager.parked_scroll;
+    chat_view.velocity = 0;
+    chat_view.target = -1;
+    chat_view.stick_to_bottom = lobby_manager.parked_at_bottom;
+    chat_view.unread_after = read_watermarks.Get( lobby_manager.id );
+    screen_state = eScreenState::LOBBY;
+}
+
+void SessionManager::Close( uint64 lobby ) {
+    LobbySession* session = Find( lobby );
+    std::vector<uint64> members = session != NULL ? session->members : std::vector<uint64> {};
+    routes.erase( lobby );
+    for ( uint64 member : members ) {
+        if ( !Shares( member ) ) {
+            avatars.Forget( member );
+        }
+    }
+    tabs.erase( std::remove( tabs.begin(), tabs.end(), lobby ), tabs.end() );
+
+    auto it = parked.find( lobby );
+    if ( it != parked.end() ) {
+        it->second->Leave();
+        parked.erase( it );
+        return;
+    }
+    if ( lobby != lobby_manager.id ) {
+        return;
+    }
+    lobby_manager.LeaveLobby();
+    if ( tabs.empty() || !Switch( tabs.back() ) ) {
+        screen_state = eScreenState::OUTSIDE_LOBBY;
+    }
+}
+
+void SessionManager::CloseAll() {
+    for ( auto& [lobby, session] : parked ) {
+        session->Leave();
+    }
+    parked.clear();
+    routes.clear();
+    tabs.clear();
+    lobby_manager.LeaveLobby();
+}
+
+void SessionManager::Update() {
+    double now = GetTime();
+    for ( auto& [lobby, session] : routes ) {
+        if ( !session->ping_location_published ) {
+            session->PublishPingLocation();
+        }
+        if ( session->roster_dirty && now - session->roster_published > ROSTER_PUBLISH_INTERVAL ) {
+            session->PublishRoster();
+        }
+    }
+}
+
+bool SessionManager::Shares( uint64 member ) const {
+    for ( auto& [lobby, session] : routes ) {
+        if ( std::find( session->members.begin(), session->members.end(), member ) != session->members.end() ) {
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t SessionManager::Unread( uint64 lobby ) const {
+    auto it = parked.find( lobby );
+    if ( it == parked.end() ) {
+        return 0;
+    }
+    const LobbySession& session = *it->second;
+    return session.messages.size() - session.time_index.LowerBound( session.messages, read_watermarks.Get( lobby ) + 1 );
+}
+
+// Call Backs
+
+void SessionManager::OnLobbyChatUpdate( LobbyChatUpdate_t *pCallback ) {
+    TRACE_SCOPE( "OnLobbyChatUpdate", "callback" );
+    HistogramTimer timer( metrics.callback_us );
+    LobbySession* session = Find( pCallback->m_ulSteamIDLobby );
+    if ( session == NULL ) {
+        return; // a shard we only bridge
+    }
+
+    // A recording replays into one lobby, the displayed one
+    if ( recorder.IsOpen() && session->Foreground() ) {
+        recorder.RecordChatUpdate( pCallback );
+    }
+
+    // Only the member that changed, so the members panel updates in place
+    session->HandleMemberChange( pCallback->m_ulSteamIDUserChanged, pCallback->m_rgfChatMemberStateChange );
+    session->CheckOwner();
+    if ( session->Foreground() ) {
+        metrics.members.Set( session->members.size() );
+    }
+
+    switch (pCallback->m_rgfChatMemberStateChange) {
+        case k_EChatMemberStateChangeEntered:
+            metrics.members_joined.Add();
+            break;
+        case k_EChatMemberStateChangeLeft:
+        case k_EChatMemberStateChangeDisconnected:
+        case k_EChatMemberStateChangeKicked:
+        case k_EChatMemberStateChangeBanned:
+            metrics.members_left.Add();
+            break;
+    }
+}
+
+void SessionManager::OnLobbyChatMsg( LobbyChatMsg_t *pCallback ) {
+    TRACE_SCOPE( "OnLobbyChatMsg", "callback" );
+    HistogramTimer timer( metrics.callback_us );
+    if ( pCallback->m_eChatEntryType == 0 ) {
+        TraceLog(LOG_ERROR, "Invalid Message recieved");
+        return;
+    }
+
+    uint32 chatID = pCallback->m_iChatID;
+    uint64 lobbyID = pCallback->m_ulSteamIDLobby;
+    CSteamID sender = pCallback->m_ulSteamIDUser;
+
+    char recievedMsg[MAX_CHATMSG_SIZE];
+    int end = SteamMatchmaking()->GetLobbyChatEntry( lobbyID, chatID, &sender, recievedMsg, MAX_CHATMSG_SIZE, NULL);
+
+    if ( lobbyID == shard_manager.Home() ? shard_manager.Bridging() : shard_manager.Bridges( lobbyID ) ) {
+        shard_manager.Relay( lobbyID, chatID, sender.ConvertToUint64(), recievedMsg, end );
+    }
+    LobbySession* session = Find( lobbyID );
+    if ( session == NULL ) {
+        return; // shown once it's relayed into our own shard
+    }
+
+    if ( recorder.IsOpen() && session->Foreground() ) {
+        recorder.RecordChatMsg( pCallback, recievedMsg, end );
+    }
+
+    session->HandleChatEntry( sender.ConvertToUint64(), recievedMsg, end );
+}
+
+void SessionManager::OnLobbyDataUpdate( LobbyDataUpdate_t *pCallback ) {
+    if ( !pCallback->m_bSuccess || pCallback->m_ulSteamIDMember != pCallback->m_ulSteamIDLobby ) {
+        return;
+    }
+    if ( LobbySession* session = Find( pCallback->m_ulSteamIDLobby ) ) {
+        session->CheckOwner();
+    }
+}
+
+// Lobby Metadata Implementation
+
+const LobbyMetadata::Info& LobbyMetadata::Get( uint64 lobby ) {
+    auto it = lobbies.find( lobby );
+    if ( it != lobbies.end() && !it->second.stale ) {
+        return it->second.info;
+    }
+    return Refresh( lobby );
+}
+
+const LobbyMetadata::Info& LobbyMetadata::Refresh( uint64 lobby ) {
+    Entry& entry = lobbies[lobby];
+    Info& info = entry.info;
+    info = Info {};
+    entry.stale = false;
+
+    char key[k_nMaxLobbyKeyLength + 1];
+    static char value[k_cubChatMetadataMax];
+    int count = SteamMatchmaking()->GetLobbyDataCount( lobby );
+    for ( int i = 0; i < count; i++ ) {
+        if ( SteamMatchmaking()->GetLobbyDataByIndex( lobby, i, key, sizeof( key ), value, sizeof( value ) ) ) {
+            info.values[key] = value;
+        }
+    }
+
+    auto text = [&info]( const char* key ) -> std::string {
+        auto found = info.values.find( key );
+        return found != info.values.end() ? found->second : std::string();
+    };
+    info.name = text( "lobby_name" );
+    info.leader = text( "lobby_leader" );
+    info.app = text( "app" );
+    info.ping_location = text( "ping_location" );
+    info.version = atoi( text( "version" ).c_str() );
+    info.room = strtoull( text( "room" ).c_str(), NULL, 10 );
+    info.shard = atoi( text( "shard" ).c_str() );
+    info.parent = strtoull( text( "parent" ).c_str(), NULL, 10 );
+    info.child = strtoull( text( "child" ).c_str(), NULL, 10 );
+    info.successor = strtoull( text( "successor" ).c_str(), NULL, 10 );
+    std::string roster = text( "roster" );
+    for ( const char* cursor = roster.c_str(); *cursor; ) {
+        char* end;
+        uint64 member = strtoull( cursor, &end, 16 );
+        if ( end == cursor ) break;
+        info.roster.push_back( member );
+        cursor = end;
+    }
+    return info;
+}
+
+const std::string& LobbyMetadata::Value( uint64 lobby, const std::string& key ) {
+    static const std::string none;
+    const Info& info = Get( lobby );
+    auto it = info.values.find( key );
+    return it != info.values.end() ? it->second : none;
+}
+
+void LobbyMetadata::Invalidate( uint64 lobby ) {
+    auto it = lobbies.find( lobby );
+    if ( it != lobbies.end() ) {
+        it->second.stale = true;
+    }
+}
+
+// Only the lobby's own data, member data changes come through here too
+void LobbyMetadata::OnLobbyDataUpdate( LobbyDataUpdate_t *pCallback ) {
+    if ( !pCallback->m_bSuccess ) {
+        lobbies.erase( pCallback->m_ulSteamIDLobby ); // the lobby is gone
+    } else if ( pCallback->m_ulSteamIDMember == pCallback->m_ulSteamIDLobby ) {
+        Invalidate( pCallback->m_ulSteamIDLobby );
+    }
+}
+
+// Lobby Prefetcher Implementation
+
+void LobbyPrefetcher::Prefetch( uint64 lobby ) {
+    double now = GetTime();
+    auto it = requests.find( lobby );
+    if ( it != requests.end() && now - it->second.time < PREFETCH_INTERVAL ) {
+        return;
+    }
+
+    if ( requests.size() > 256 ) {
+        for ( auto old = requests.begin(); old != requests.end(); ) {
+            old = now - old->second.time > PREFETCH_INTERVAL ? requests.erase( old ) : std::next( old );
+        }
+    }
+    requests[lobby] = Request { now, true };
+    SteamMatchmaking()->RequestLobbyData( lobby );
+}
+
+void LobbyPrefetcher::Warm( const LobbyMetadata::Info& info ) {
+    for ( size_t i = 0; i < info.roster.size(); i++ ) {
+        if ( i < PREFETCH_AVATARS ) {
+            avatars.Prefetch( info.roster[i] ); // asks for the persona too if Steam doesn't have it
+        } else {
+            SteamFriends()->RequestUserInformation( info.roster[i], true );
+        }
+    }
+}
+
+// Read with Refresh, the metadata cache may not have seen this update yet
+void LobbyPrefetcher::OnLobbyDataUpdate( LobbyDataUpdate_t *pCallback ) {
+    auto it = requests.find( pCallback->m_ulSteamIDLobby );
+    if ( it == requests.end() || !it->second.waiting || pCallback->m_ulSteamIDMember != pCallback->m_ulSteamIDLobby ) {
+        return;
+    }
+    it->second.waiting = false;
+    if ( pCallback->m_bSuccess ) {
+        Warm( lobby_metadata.Refresh( pCallback->m_ulSteamIDLobby ) );
+    }
+}
+
+void LobbyPrefetcher::OnLobbyInvite( LobbyInvite_t *pCallback ) {
+    TraceLog( LOG_INFO, "Invited to lobby %llu", pCallback->m_ulSteamIDLobby );
+    avatars.Prefetch( pCallback->m_ulSteamIDUser );
+    Prefetch( pCallback->m_ulSteamIDLobby );
+}
+
+// Accepted from the Steam overlay, join straight away. The lobby is usually warm from the invite
+void LobbyPrefetcher::OnJoinRequested( GameLobbyJoinRequested_t *pCallback ) {
+    if ( join_pipeline.Active() || screen_state == eScreenState::LOADING ) {
+        return;
+    }
+    lobby_manager.JoinLobby( pCallback->m_steamIDLobby.ConvertToUint64() );
+}
+
+// Join Pipeline Implementation
+
+static const char* join_stage_names[JOIN_STAGE_COUNT] = { "enter", "lobby data", "members", "history", "avatars" };
+
+void JoinPipeline::Begin() {
+    active = true;
+    lobby = 0;
+    done = 0;
+    start_us = Tracer::Now();
+    entered_us = first_paint_us = interactive_us = 0;
+    unresolved.clear();
+    avatar_members.clear();
+    screen_state = eScreenState::LOBBY;
+}
+
+void JoinPipeline::Start( uint64 target ) {
+    Begin();
+    member_list.Clear();
+    Target( target );
+}
+
+void JoinPipeline::Resume( uint64 target ) {
+    Begin();
+    Complete( JOIN_HISTORY );
+    Target( target );
+}
+
+void JoinPipeline::Target( uint64 target ) {
+    if ( !active ) {
+        Start( target );
+        return;
+    }
+    if ( target == lobby ) {
+        return;
+    }
+    lobby = target;
+
+    // Recently hovered or invited lobbies are already warm, the rest get asked for now
+    lobby_prefetcher.Prefetch( lobby );
+    const LobbyMetadata::Info& info = lobby_metadata.Get( lobby );
+    if ( !info.name.empty() ) {
+        member_list.Reset( info.roster );
+        Complete( JOIN_METADATA );
+    }
+}
+
+void JoinPipeline::OnEntered( const std::vector<uint64>& members ) {
+    if ( !active ) {
+        return;
+    }
+    entered_us = Tracer::Now();
+    Complete( JOIN_ENTER );
+    Complete( JOIN_METADATA ); // OnLobbyJoin read it, whether or not the request came back yet
+    Complete( JOIN_HISTORY );  // message store reset or kept from the snapshot, chat view at the read watermark
+
+    // Members Steam still has to look up, the panel fills in as they arrive
+    unresolved.clear();
+    for ( uint64 member : members ) {
+        if ( SteamFriends()->RequestUserInformation( member, true ) ) {
+            unresolved.push_back( member );
+        }
+    }
+    avatar_members.assign( members.begin(), members.begin() + MIN( members.size(), (size_t) PREFETCH_AVATARS ) );
+    for ( uint64 member : avatar_members ) {
+        avatars.Prefetch( member );
+    }
+    Update();
+}
+
+void JoinPipeline::Fail() {
+    if ( active ) {
+        TraceLog( LOG_WARNING, "Join of lobby %llu failed after %.0f ms", lobby, (Tracer::Now() - start_us) / 1e3 );
+    }
+    active = false;
+    member_list.Clear();
+}
+
+void JoinPipeline::Update() {
+    if ( !active || !Done( JOIN_ENTER ) ) {
+        return;
+    }
+    bool timed_out = (Tracer::Now() - entered_us) / 1e6 > JOIN_STAGE_TIMEOUT;
+
+    if ( !Done( JOIN_MEMBERS ) && (unresolved.empty() || timed_out) ) {
+        Complete( JOIN_MEMBERS );
+    }
+    if ( !Done( JOIN_AVATARS ) ) {
+        bool ready = std::all_of( avatar_members.begin(), avatar_members.end(), []( uint64 member ) { return avatars.Ready( member ); } );
+        if ( ready || timed_out ) {
+            Complete( JOIN_AVATARS );
+        }
+    }
+}
+
+void JoinPipeline::OnPaint() {
+    if ( active && first_paint_us == 0 ) {
+        first_paint_us = Tracer::Now();
+        metrics.join_first_paint_ms.Record( (first_paint_us - start_us) / 1000 );
+    }
+}
+
+void JoinPipeline::Complete( eJoinStage stage ) {
+    if ( Done( stage ) ) {
+        return;
+    }
+    done |= 1u << stage;
+    stage_us[stage] = Tracer::Now();
+    if ( tracer.enabled ) {
+        tracer.Span( join_stage_names[stage], "join", start_us, stage_us[stage] );
+    }
+
+    if ( interactive_us == 0 && Interactive() ) {
+        interactive_us = stage_us[stage];
+        metrics.join_interactive_ms.Record( (interactive_us - start_us) / 1000 );
+    }
+    if ( done == (1u << JOIN_STAGE_COUNT) - 1 ) {
+        Finish();
+    }
+}
+
+void JoinPipeline::Finish() {
+    active = false;
+    std::string stages;
+    for ( int i = 0; i < JOIN_STAGE_COUNT; i++ ) {
+        stages += TextFormat( "%s%s %.0f ms", i ? ", " : "", join_stage_names[i], (stage_us[i] - start_us) / 1e3 );
+    }
+    TraceLog( LOG_INFO, "Joined lobby %llu: first paint %.0f ms, interactive %.0f ms (%s)", lobby,
+              first_paint_us ? (first_paint_us - start_us) / 1e3 : 0.0, (interactive_us - start_us) / 1e3, stages.c_str() );
+}
+
+std::string JoinPipeline::Status() const {
+    std::string status = "joining, waiting for";
+    for ( int i = 0; i < JOIN_STAGE_COUNT; i++ ) {
+        if ( !Done( static_cast<eJoinStage>( i ) ) ) {
+            status += " ";
+            status += join_stage_names[i];
+        }
+    }
+    return status;
+}
+
+void JoinPipeline::OnLobbyDataUpdate( LobbyDataUpdate_t *pCallback ) {
+    if ( !active || pCallback->m_ulSteamIDLobby != lobby || pCallback->m_ulSteamIDMember != lobby || Done( JOIN_METADATA ) ) {
+        return;
+    }
+    if ( !pCallback->m_bSuccess ) {
+        return; // the lobby is gone, LobbyEnter_t will say so too
+    }
+    // Only a preview, the real member list replaces it on entry
+    if ( !Done( JOIN_ENTER ) ) {
+        member_list.Reset( lobby_metadata.Refresh( lobby ).roster );
+    }
+    Complete( JOIN_METADATA );
+}
+
+void JoinPipeline::OnPersonaStateChange( PersonaStateChange_t *pCallback ) {
+    auto it = std::find( unresolved.begin(), unresolved.end(), pCallback->m_ulSteamID );
+    if ( it != unresolved.end() ) {
+        unresolved.erase( it );
+    }
+}
+
+// Presence Implementation
+
+// Any key or mouse button held. GetKeyPressed / GetCharPressed would pop the
+// queues the chat box and raygui read from, so the key states are polled instead
+static bool AnyInputDown() {
+    for ( int key = KEY_SPACE; key <= KEY_KB_MENU; key++ ) {
+        if ( IsKeyDown( key ) ) {
+            return true;
+        }
+    }
+    return IsMouseButtonDown( MOUSE_BUTTON_LEFT ) || IsMouseButtonDown( MOUSE_BUTTON_RIGHT ) || IsMouseButtonDown( MOUSE_BUTTON_MIDDLE );
+}
+
+void Presence::Update() {
+    double now = GetTime();
+    Vector2 mouse = GetMousePosition();
+    if ( mouse.x != last_mouse.x || mouse.y != last_mouse.y || GetMouseWheelMove() != 0
+         || chat_input.LastEdit() > last_input || AnyInputDown() ) {
+        last_input = now;
+        last_mouse = mouse;
+    }
+    if ( lobby == 0 || lobby != lobby_manager.id ) {
+        return;
+    }
+
+    uint8 state = 0;
+    if ( now - last_input > PRESENCE_IDLE_AFTER ) {
+        state |= PRESENCE_IDLE;
+    }
+    if ( chat_input.Size() > 0 && chat_input.LastEdit() >= 0 && now - chat_input.LastEdit() < PRESENCE_TYPING_TIMEOUT ) {
+        state |= PRESENCE_TYPING;
+    }
+    if ( state == published || now - last_publish < interval ) {
+        return;
+    }
+
+    SteamMatchmaking()->SetLobbyMemberData( lobby, "presence", TextFormat( "%u", state ) );
+    metrics.presence_writes.Add();
+    published = state;
+    last_publish = now;
+    Set( self, state ); // don't wait for our own LobbyDataUpdate_t
+}
+
+void Presence::Reset( uint64 target, const std::vector<uint64>& members ) {
+    // Leaving a tab mid sentence shouldn't leave us typing there
+    if ( lobby != 0 && lobby != target && published != 0xff && (published & PRESENCE_TYPING) ) {
+        SteamMatchmaking()->SetLobbyMemberData( lobby, "presence", TextFormat( "%u", published & ~PRESENCE_TYPING ) );
+        metrics.presence_writes.Add();
+    }
+    lobby = target;
+    self = SteamUser()->GetSteamID().ConvertToUint64();
+    slots.clear();
+    free_slots.clear();
+    idle.clear();
+    typing.clear();
+    typing_members.clear();
+    published = 0xff;
+    for ( uint64 member : members ) {
+        Read( member );
+    }
+}
+
+void Presence::Forget( uint64 member ) {
+    auto it = slots.find( member );
+    if ( it == slots.end() ) {
+        return;
+    }
+    Set( member, 0 );
+    free_slots.push_back( it->second );
+    slots.erase( it );
+}
+
+void Presence::Read( uint64 member ) {
+    const char* value = SteamMatchmaking()->GetLobbyMemberData( lobby, member, "presence" );
+    if ( value != NULL && *value ) {
+        Set( member, static_cast<uint8>( atoi( value ) ) );
+    }
+}
+
+void Presence::Set( uint64 member, uint8 flags ) {
+    auto it = slots.find( member );
+    if ( it == slots.end() ) {
+        if ( flags == 0 ) {
+            return; // same as not knowing them
+        }
+        uint32 slot = static_cast<uint32>( slots.size() );
+        if ( !free_slots.empty() ) {
+            slot = free_slots.back();
+            free_slots.pop_back();
+        }
+        it = slots.emplace( member, slot ).first;
+    }
+
+    bool was_typing = Test( typing, member );
+    Assign( idle, it->second, flags & PRESENCE_IDLE );
+    Assign( typing, it->second, flags & PRESENCE_TYPING );
+
+    bool is_typing = flags & PRESENCE_TYPING;
+    if ( member != self && was_typing != is_typing ) {
+        if ( is_typing ) {
+            typing_members.push_back( member );
+        } else {
+            typing_members.erase( std::find( typing_members.begin(), typing_members.end(), member ) );
+        }
+    }
+}
+
+bool Presence::Test( const std::vector<uint64>& bits, uint64 member ) const {
+    auto it = slots.find( member );
+    if ( it == slots.end() || it->second / 64 >= bits.size() ) {
+        return false;
+    }
+    return (bits[it->second / 64] >> (it->second % 64)) & 1;
+}
+
+void Presence::Assign( std::vector<uint64>& bits, uint32 slot, bool value ) {
+    if ( slot / 64 >= bits.size() ) {
+        if ( !value ) {
+            return;
+        }
+        bits.resize( slot / 64 + 1 );
+    }
+    uint64 mask = 1ull << (slot % 64);
+    bits[slot / 64] = value ? bits[slot / 64] | mask : bits[slot / 64] & ~mask;
+}
+
+// Member data changes come with the member set, the lobby's own with the lobby id
+void Presence::OnLobbyDataUpdate( LobbyDataUpdate_t *pCallback ) {
+    if ( pCallback->m_bSuccess && pCallback->m_ulSteamIDLobby == lobby && pCallback->m_ulSteamIDMember != lobby ) {
+        Read( pCallback->m_ulSteamIDMember );
+    }
+}
+
+// Lobby Browser Implementation
+
+void LobbyBrowser::Refresh() {
+    if ( in_flight || shard_manager.Querying() ) {
+        queued = true;
+        return;
+    }
+
+    // Filters only apply to the next RequestLobbyList, so they're set every time
+    SteamMatchmaking()->AddRequestLobbyListStringFilter( "app", LOBBY_APP_TAG, k_ELobbyComparisonEqual );
+    SteamMatchmaking()->AddRequestLobbyListNumericalFilter( "version", LOBBY_PROTOCOL_VERSION, k_ELobbyComparisonEqual );
+    if ( free_slots_only ) {
+        SteamMatchmaking()->AddRequestLobbyListFilterSlotsAvailable( 1 );
+    }
+    SteamMatchmaking()->AddRequestLobbyListDistanceFilter( k_ELobbyDistanceFilterWorldwide );
+    SteamMatchmaking()->AddRequestLobbyListResultCountFilter( LOBBY_BROWSER_MAX_RESULTS );
+
+    SteamAPICall_t hSteamAPICall = SteamMatchmaking()->RequestLobbyList();
+    m_LobbyListCallResult.Set( hSteamAPICall, this, &LobbyBrowser::OnLobbyList );
+    in_flight = true;
+    queued = false;
+}
+
+void LobbyBrowser::Update() {
+    double now = GetTime();
+    if ( !in_flight && (queued || (last_refresh >= 0 && now - last_refresh > LOBBY_BROWSER_REFRESH_INTERVAL)) ) {
+        Refresh();
+    }
+
+    // Kicks off a re-measure in the background once our own data is stale. The
+    // estimates are cheap and local, so they're just redone against whatever we have
+    if ( now - last_ping_check > LOBBY_PING_CHECK_INTERVAL ) {
+        last_ping_check = now;
+        SteamNetworkingUtils()->CheckPingDataUpToDate( LOBBY_PING_MAX_AGE );
+        for ( auto& it : entries ) {
+            if ( EstimatePing( it.second ) ) {
+                visible_dirty = true;
+            }
+        }
+    }
+}
+
+bool LobbyBrowser::EstimatePing( Entry& entry ) {
+    int ping = entry.has_location ? SteamNetworkingUtils()->EstimatePingTimeFromLocalHost( entry.location ) : -1;
+    ping = ping >= 0 ? ping : -1;
+    if ( ping == entry.ping ) {
+        return false;
+    }
+    entry.ping = ping;
+    BuildLabel( entry );
+    return true;
+}
+
+void LobbyBrowser::BuildLabel( Entry& entry ) {
+    entry.label = entry.name + "  (" + std::to_string( entry.room_members ) + "/" + std::to_string( entry.room_max_members ) + ")  by " + entry.leader;
+    if ( entry.room_shards > 1 ) {
+        entry.label += "  " + std::to_string( entry.room_shards ) + " shards";
+    }
+    entry.label += entry.ping >= 0 ? "  " + std::to_string( entry.ping ) + " ms" : "  ? ms";
+}
+
+void LobbyBrowser::SetFilter( const char* text ) {
+    std::string folded = text;
+    for ( char& c : folded ) {
+        c = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+    if ( folded != filter ) {
+        filter = std::move( folded );
+        page = 0;
+        visible_dirty = true;
+    }
+}
+
+// Server side filter, so it takes a new query. The cache keeps showing until it's back
+void LobbyBrowser::SetFreeSlotsOnly( bool only ) {
+    if ( only != free_slots_only ) {
+        free_slots_only = only;
+        Refresh();
+    }
+}
+
+const std::vector<const LobbyBrowser::Entry*>& LobbyBrowser::Visible() {
+    if ( !visible_dirty ) {
+        return visible;
+    }
+    visible_dirty = false;
+    visible.clear();
+    for ( const auto& it : entries ) {
+        if ( it.second.head && (filter.empty() || it.second.folded.find( filter ) != std::string::npos) ) {
+            visible.push_back( &it.second );
+        }
+    }
+    std::sort( visible.begin(), visible.end(), []( const Entry* a, const Entry* b ) {
+        // Unknown ping sorts last
+        unsigned a_bucket = static_cast<unsigned>( a->ping ) / LOBBY_PING_BUCKET_MS;
+        unsigned b_bucket = static_cast<unsigned>( b->ping ) / LOBBY_PING_BUCKET_MS;
+        if ( a_bucket != b_bucket ) return a_bucket < b_bucket;
+        if ( a->room_members != b->room_members ) return a->room_members > b->room_members;
+        if ( a->name != b->name ) return a->name < b->name;
+        return a->id < b->id;
+    } );
+    return visible;
+}
+
+void LobbyBrowser::OnLobbyList( LobbyMatchList_t *pCallback, bool bIOFailure ) {
+    TRACE_SCOPE( "OnLobbyList", "callback" );
+    HistogramTimer timer( metrics.callback_us );
+    in_flight = false;
+    if ( bIOFailure ) {
+        TraceLog( LOG_ERROR, "Lobby list request failed, keeping the cached results" );
+        last_refresh = GetTime(); // retried after the usual interval
+        shard_manager.SendQueuedQuery();
+        return;
+    }
+
+    generation++;
+    added = changed = removed = 0;
+    for ( uint32 i = 0; i < pCallback->m_nLobbiesMatching; i++ ) {
+        uint64 id = SteamMatchmaking()->GetLobbyByIndex( i ).ConvertToUint64();
+        const LobbyMetadata::Info& info = lobby_metadata.Refresh( id );
+        if ( info.app != LOBBY_APP_TAG || info.version != LOBBY_PROTOCOL_VERSION ) {
+            continue; // didn't pass our filters, so not an answer to our query
+        }
+        const std::string& name = info.name;
+        const std::string& leader = info.leader;
+        int members = SteamMatchmaking()->GetNumLobbyMembers( id );
+        int max_members = SteamMatchmaking()->GetLobbyMemberLimit( id );
+        const std::string& ping_location = info.ping_location;
+        uint64 room = info.room;
+        int shard = info.shard;
+
+        auto result = entries.emplace( id, Entry {} );
+        Entry& entry = result.first->second;
+        entry.seen = generation;
+        if ( !result.second && entry.name == name && entry.leader == leader && entry.ping_location == ping_location
+             && entry.members == members && entry.max_members == max_members && entry.room == room && entry.shard == shard ) {
+            continue;
+        }
+
+        ( result.second ? added : changed )++;
+        entry.id = id;
+        entry.name = name;
+        entry.leader = leader;
+        entry.members = members;
+        entry.max_members = max_members;
+        entry.room = room;
+        entry.shard = shard;
+        entry.room_members = members;
+        entry.room_max_members = max_members;
+        if ( entry.ping_location != ping_location ) {
+            entry.ping_location = ping_location;
+            entry.has_location = SteamNetworkingUtils()->ParsePingLocationString( ping_location.c_str(), entry.location );
+        }
+        if ( !EstimatePing( entry ) ) {
+            BuildLabel( entry );
+        }
+        entry.folded = entry.name + " " + entry.leader;
+        for ( char& c : entry.folded ) {
+            c = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+        }
+    }
+
+    for ( auto it = entries.begin(); it != entries.end(); ) {
+        if ( it->second.seen != generation ) {
+            if ( !session_manager.Has( it->first ) && !shard_manager.Bridges( it->first ) ) {
+                lobby_metadata.Forget( it->first );
+            }
+            it = entries.erase( it );
+            removed++;
+        } else {
+            ++it;
+        }
+    }
+
+    // Shards of one room list as a single row with the room's totals
+    struct Totals { int members = 0, max_members = 0, shards = 0; Entry* head = nullptr; };
+    std::unordered_map<uint64, Totals> rooms;
+    for ( auto& it : entries ) {
+        Entry& entry = it.second;
+        Totals& totals = rooms[entry.room ? entry.room : entry.id];
+        totals.members += entry.members;
+        totals.max_members += entry.max_members;
+        totals.shards++;
+        if ( !totals.head || entry.shard < totals.head->shard ) {
+            totals.head = &entry;
+        }
+    }
+    for ( auto& it : entries ) {
+        Entry& entry = it.second;
+        const Totals& totals = rooms[entry.room ? entry.room : entry.id];
+        bool head = totals.head == &entry;
+        if ( head != entry.head ) {
+            entry.head = head;
+            visible_dirty = true;
+        }
+        if ( head && (entry.room_members != totals.members || entry.room_max_members != totals.max_members
+                      || entry.room_shards != totals.shards) ) {
+            entry.room_members = totals.members;
+            entry.room_max_members = totals.max_members;
+            entry.room_shards = totals.shards;
+            BuildLabel( entry );
+            visible_dirty = true;
+        }
+    }
+
+    if ( added || changed || removed ) {
+        visible_dirty = true;
+    }
+    last_refresh = GetTime();
+    shard_manager.SendQueuedQuery();
+}
+
+// Shard Manager Implementation
+
+uint64 ShardManager::Envelope::Key() const {
+    uint8 bytes[12];
+    memcpy( bytes, &origin_lobby, 8 );
+    memcpy( bytes + 8, &origin_chat_id, 4 );
+    return HashBytes( reinterpret_cast<const char*>( bytes ), sizeof( bytes ) );
+}
+
+bool ShardManager::IsRelay( const char* data, int size ) {
+    return size >= RELAY_HEADER_SIZE && memcmp( data, RELAY_MAGIC, 3 ) == 0;
+}
+
+ShardManager::Envelope ShardManager::Unwrap( const char* data ) {
+    const uint8* header = reinterpret_cast<const uint8*>( data );
+    Envelope envelope = { 0, 0, 0 };
+    for ( int b = 0; b < 8; b++ ) envelope.origin_lobby |= static_cast<uint64>( header[3 + b] ) << (8 * b);
+    for ( int b = 0; b < 4; b++ ) envelope.origin_chat_id |= static_cast<uint32>( header[11 + b] ) << (8 * b);
+    for ( int b = 0; b < 8; b++ ) envelope.sender |= static_cast<uint64>( header[15 + b] ) << (8 * b);
+    return envelope;
+}
+
+bool ShardManager::RecentIds::Insert( uint64 key ) {
+    if ( !keys.emplace( key, true ).second ) {
+        return false;
+    }
+    order.push_back( key );
+    if ( order.size() > RELAY_SEEN_LIMIT ) {
+        keys.erase( order.front() );
+        order.pop_front();
+    }
+    return true;
+}
+
+bool ShardManager::Bridges( uint64 lobby ) const {
+    return std::find( bridged.begin(), bridged.end(), lobby ) != bridged.end();
+}
+
+void ShardManager::Relay( uint64 from, uint32 chat_id, uint64 sender, const char* data, int size ) {
+    Envelope envelope = { from, chat_id, sender };
+    if ( IsRelay( data, size ) ) {
+        envelope = Unwrap( data );
+        data += RELAY_HEADER_SIZE;
+        size -= RELAY_HEADER_SIZE;
+    }
+    if ( size < 0 || size > CHAT_ENTRY_BUDGET || !relayed.Insert( envelope.Key() ) ) {
+        return; // already forwarded it, or too big to wrap (an old client)
+    }
+
+    char entry[MAX_CHATMSG_SIZE];
+    memcpy( entry, RELAY_MAGIC, 3 );
+    for ( int b = 0; b < 8; b++ ) entry[3 + b] = static_cast<char>( envelope.origin_lobby >> (8 * b) );
+    for ( int b = 0; b < 4; b++ ) entry[11 + b] = static_cast<char>( envelope.origin_chat_id >> (8 * b) );
+    for ( int b = 0; b < 8; b++ ) entry[15 + b] = static_cast<char>( envelope.sender >> (8 * b) );
+    memcpy( entry + RELAY_HEADER_SIZE, data, size );
+
+    // Every lobby we sit in except where it came from and where it started
+    std::vector<uint64> targets = bridged;
+    targets.push_back( home );
+    for ( uint64 target : targets ) {
+        if ( target == from || target == envelope.origin_lobby ) {
+            continue;
+        }
+        if ( SteamMatchmaking()->SendLobbyChatMsg( target, entry, RELAY_HEADER_SIZE + size ) ) {
+            metrics.messages_relayed.Add();
+        } else {
+            metrics.send_failures.Add();
+        }
+    }
+}
+
+void ShardManager::Update() {
+    double now = GetTime();
+    if ( now - last_check < SHARD_CHECK_INTERVAL ) {
+        return;
+    }
+    last_check = now;
+
+    // Follows the displayed tab, but stays with its room while it holds bridges there
+    if ( bridged.empty() && joining_bridge == 0 && spawning_from == 0 ) {
+        home = lobby_manager.id;
+    }
+    CSteamID self = SteamUser()->GetSteamID();
+    std::vector<uint64> lobbies = bridged;
+    lobbies.push_back( home );
+    for ( uint64 lobby : lobbies ) {
+        if ( SteamMatchmaking()->GetLobbyOwner( lobby ) != self ) {
+            continue;
+        }
+
+        // Owners bridge to the parent shard. Covers ownership passing to someone new
+        const LobbyMetadata::Info& info = lobby_metadata.Get( lobby );
+        uint64 parent = info.parent;
+        if ( parent != 0 && parent != home && !Bridges( parent ) && joining_bridge == 0 ) {
+            joining_bridge = parent;
+            m_BridgeJoinCallResult.Set( SteamMatchmaking()->JoinLobby( parent ), this, &ShardManager::OnBridgeJoined );
+        }
+
+        // The newest shard is the one without a child, it opens the next when it fills up
+        bool newest = info.child == 0;
+        if ( newest && spawning_from == 0 && SteamMatchmaking()->GetNumLobbyMembers( lobby ) >= SHARD_SPAWN_MEMBERS ) {
+            Spawn( lobby );
+        }
+    }
+}
+
+void ShardManager::Spawn( uint64 full_lobby ) {
+    TraceLog( LOG_INFO, "Lobby %llu is nearly full, opening another shard", full_lobby );
+    spawning_from = full_lobby;
+    m_ShardCreateCallResult.Set( SteamMatchmaking()->CreateLobby( k_ELobbyTypePublic, LOBBY_MAX_MEMBERS ), this, &ShardManager::OnShardCreated );
+}
+
+void ShardManager::OnShardCreated( LobbyCreated_t *pCallback, bool bIOFailure ) {
+    TRACE_SCOPE( "OnShardCreated", "callback" );
+    HistogramTimer timer( metrics.callback_us );
+    uint64 parent = spawning_from;
+    spawning_from = 0;
+    if ( bIOFailure || pCallback->m_eResult != k_EResultOK ) {
+        TraceLog( LOG_ERROR, "Couldn't create a shard for lobby %llu", parent );
+        return; // tried again on a later Update
+    }
+
+    uint64 shard = pCallback->m_ulSteamIDLobby;
+    const LobbyMetadata::Info& info = lobby_metadata.Get( parent );
+    std::string room = std::to_string( info.room ? info.room : parent );
+    int index = info.shard + 1;
+
+    // Same name and tags as the room, so the browser groups it and JoinRoom finds it
+    const char* keys[] = { "lobby_name", "lobby_leader", "app", "version" };
+    for ( const char* key : keys ) {
+        SteamMatchmaking()->SetLobbyData( shard, key, lobby_metadata.Value( parent, key ).c_str() );
+    }
+    SteamMatchmaking()->SetLobbyData( shard, "room", room.c_str() );
+    SteamMatchmaking()->SetLobbyData( shard, "shard", TextFormat( "%d", index ) );
+    SteamMatchmaking()->SetLobbyData( shard, "parent", TextFormat( "%llu", parent ) );
+    char ping_location[k_cchMaxSteamNetworkingPingLocationString];
+    if ( LocalPingLocation( ping_location, sizeof( ping_location ) ) ) {
+        SteamMatchmaking()->SetLobbyData( shard, "ping_location", ping_location );
+    }
+
+    SteamMatchmaking()->SetLobbyData( parent, "room", room.c_str() );
+    SteamMatchmaking()->SetLobbyData( parent, "child", TextFormat( "%llu", shard ) );
+    SteamMatchmaking()->SetLinkedLobby( parent, shard );
+
+    // We own the new shard and sit in its parent, so we're its bridge
+    bridged.push_back( shard );
+    TraceLog( LOG_INFO, "Opened shard %d (%llu) of room %s", index, shard, room.c_str() );
+}
+
+void ShardManager::OnBridgeJoined( LobbyEnter_t *pCallback, bool bIOFailure ) {
+    uint64 lobby = joining_bridge;
+    joining_bridge = 0;
+    if ( bIOFailure || pCallback->m_EChatRoomEnterResponse != k_EChatRoomEnterResponseSuccess ) {
+        TraceLog( LOG_WARNING, "Couldn't join shard %llu as a bridge", lobby );
+        return;
+    }
+    bridged.push_back( pCallback->m_ulSteamIDLobby );
+}
+
+void ShardManager::JoinRoom( uint64 lobby ) {
+    if ( session_manager.Switch( lobby ) ) {
+        return; // already in it, in another tab
+    }
+    session_manager.Park();
+    join_pipeline.Start( lobby );
+    joining_room = lobby;
+    QueryRoom();
+}
+
+void ShardManager::QueryRoom() {
+    // A second RequestLobbyList would cancel the browser's, and its filters would mix with ours
+    if ( lobby_browser.Busy() ) {
+        room_query_queued = true;
+        return;
+    }
+    room_query_queued = false;
+    room_query_in_flight = true;
+    SteamMatchmaking()->AddRequestLobbyListStringFilter( "room", TextFormat( "%llu", joining_room ), k_ELobbyComparisonEqual );
+    SteamMatchmaking()->AddRequestLobbyListFilterSlotsAvailable( 1 );
+    SteamMatchmaking()->AddRequestLobbyListDistanceFilter( k_ELobbyDistanceFilterWorldwide );
+    SteamMatchmaking()->AddRequestLobbyListResultCountFilter( 50 );
+    m_RoomListCallResult.Set( SteamMatchmaking()->RequestLobbyList(), this, &ShardManager::OnRoomList );
+}
+
+void ShardManager::SendQueuedQuery() {
+    if ( room_query_queued ) {
+        QueryRoom();
+    }
+}
+
+void ShardManager::OnRoomList( LobbyMatchList_t *pCallback, bool bIOFailure ) {
+    TRACE_SCOPE( "OnRoomList", "callback" );
+    room_query_in_flight = false;
+    uint64 best = joining_room;
+    int best_members = INT_MAX;
+    std::string room = std::to_string( joining_room );
+
+    // Only results that are still in the room we asked for count, anything else
+    // means the list isn't the answer to our query and the room's first lobby is joined
+    for ( uint32 i = 0; !bIOFailure && i < pCallback->m_nLobbiesMatching; i++ ) {
+        uint64 lobby = SteamMatchmaking()->GetLobbyByIndex( i ).ConvertToUint64();
+        int members = SteamMatchmaking()->GetNumLobbyMembers( lobby );
+        if ( std::to_string( lobby_metadata.Refresh( lobby ).room ) == room && members < best_members ) {
+            best = lobby;
+            best_members = members;
+        }
+    }
+    lobby_manager.JoinLobby( best );
+}
+
+void ShardManager::LeaveAll() {
+    for ( uint64 lobby : bridged ) {
+        SteamMatchmaking()->LeaveLobby( lobby );
+    }
+    bridged.clear();
+    home = 0;
+}
+
+// Member List Implementation
+
+bool MemberList::Less( const Member* a, const Member* b ) const {
+    if ( sort == SORT_STATUS && a->status_rank != b->status_rank ) {
+        return a->status_rank < b->status_rank;
+    }
+    return LessFolded( a, b );
+}
+
+bool MemberList::LessFolded( const Member* a, const Member* b ) {
+    int c = a->folded.compare( b->folded );
+    return c != 0 ? c < 0 : a->id < b->id;
+}
+
+std::string MemberList::Fold( const std::string& text ) {
+    std::string folded = text;
+    for ( char& c : folded ) {
+        c = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+    return folded;
+}
+
+void MemberList::Insert( Member* member ) {
+    auto less = [this]( const Member* a, const Member* b ) { return Less( a, b ); };
+    order.insert( std::lower_bound( order.begin(), order.end(), member, less ), member );
+    prefix_index.insert( std::lower_bound( prefix_index.begin(), prefix_index.end(), member, LessFolded ), member );
+    visible_dirty = true;
+}
+
+// Keys are unique because the id breaks ties, so lower_bound lands right on the member
+void MemberList::Erase( Member* member ) {
+    auto less = [this]( const Member* a, const Member* b ) { return Less( a, b ); };
+    auto it = std::lower_bound( order.begin(), order.end(), member, less );
+    if ( it != order.end() && *it == member ) {
+        order.erase( it );
+    }
+    it = std::lower_bound( prefix_index.begin(), prefix_index.end(), member, LessFolded );
+    if ( it != prefix_index.end() && *it == member ) {
+        prefix_index.erase( it );
+    }
+    visible_dirty = true;
+}
+
+void MemberList::Reset( const std::vector<uint64>& ids ) {
+    Clear();
+    for ( uint64 id : ids ) {
+        Add( id );
+    }
+}
+
+void MemberList::Add( uint64 id ) {
+    auto result = members.emplace( id, Member {} );
+    if ( !result.second ) {
+        return;
+    }
+    result.first->second.id = id;
+    Insert( &result.first->second );
+    pending.push_back( id );
+}
+
+void MemberList::Restore( uint64 id, const std::string& name, int status_rank ) {
+    auto result = members.emplace( id, Member {} );
+    if ( !result.second ) {
+        return;
+    }
+    Member& member = result.first->second;
+    member.id = id;
+    member.name = name;
+    member.folded = Fold( name );
+    member.status_rank = status_rank;
+    Insert( &member );
+}
+
+void MemberList::Remove( uint64 id ) {
+    auto it = members.find( id );
+    if ( it == members.end() ) {
+        return;
+    }
+    Erase( &it->second );
+    members.erase( it );
+}
+
+void MemberList::Clear() {
+    members.clear();
+    order.clear();
+    prefix_index.clear();
+    pending.clear();
+    scroll = 0;
+    visible_dirty = true;
+}
+
+void MemberList::Update() {
+    for ( uint64 id : pending ) {
+        auto it = members.find( id );
+        if ( it == members.end() ) {
+            continue; // left before we got to it
+        }
+
+        Member& member = it->second;
+        std::string name = SteamFriends()->GetFriendPersonaName( id );
+        EPersonaState state = SteamFriends()->GetFriendPersonaState( id );
+        int rank = state == k_EPersonaStateOffline ? 2
+            : state == k_EPersonaStateOnline || state == k_EPersonaStateLookingToPlay || state == k_EPersonaStateLookingToTrade ? 0 : 1;
+        if ( name == member.name && rank == member.status_rank ) {
+            continue;
+        }
+
+        // Re-keying moves the member, nothing else in the orders changes
+        Erase( &member );
+        member.name = std::move( name );
+        member.folded = Fold( member.name );
+        member.status_rank = rank;
+        Insert( &member );
+    }
+    pending.clear();
+}
+
+void MemberList::SetSort( eSortMode mode ) {
+    if ( mode == sort ) {
+        return;
+    }
+    sort = mode;
+    std::sort( order.begin(), order.end(), [this]( const Member* a, const Member* b ) { return Less( a, b ); } );
+    visible_dirty = true;
+}
+
+void MemberList::SetFilter( const char* text ) {
+    std::string folded = Fold( text );
+    if ( folded != filter ) {
+        filter = std::move( folded );
+        scroll = 0;
+        visible_dirty = true;
+    }
+}
+
+const std::vector<uint64>& MemberList::Visible() {
+    if ( !visible_dirty ) {
+        return visible;
+    }
+    visible_dirty = false;
+    visible.clear();
+
+    if ( filter.empty() ) {
+        for ( const Member* member : order ) {
+            visible.push_back( member->id );
+        }
+        return visible;
+    }
+
+    // Names starting with the filter are one contiguous range of the prefix index
+    Member key;
+    key.id = 0;
+    key.folded = filter;
+    auto begin = std::lower_bound( prefix_index.begin(), prefix_index.end(), &key, LessFolded );
+    auto end = begin;
+    while ( end != prefix_index.end() && (*end)->folded.compare( 0, filter.size(), filter ) == 0 ) {
+        ++end;
+    }
+
+    // The range is in name order already, by status it only needs a stable pass on the rank
+    std::vector<Member*> matches( begin, end );
+    if ( sort == SORT_STATUS ) {
+        std::stable_sort( matches.begin(), matches.end(), []( const Member* a, const Member* b ) {
+            return a->status_rank < b->status_rank;
+        } );
+    }
+    for ( const Member* member : matches ) {
+        visible.push_back( member->id );
+    }
+    return visible;
+}
+
+const std::string& MemberList::Name( uint64 id ) const {
+    static const std::string unknown;
+    auto it = members.find( id );
+    return it != members.end() ? it->second.name : unknown;
+}
+
+bool MemberList::Away( uint64 id ) const {
+    auto it = members.find( id );
+    return it != members.end() && it->second.status_rank > 0;
+}
+
+void MemberList::OnPersonaStateChange( PersonaStateChange_t *pCallback ) {
+    if ( (pCallback->m_nChangeFlags & (k_EPersonaChangeName | k_EPersonaChangeStatus | k_EPersonaChangeGoneOffline | k_EPersonaChangeComeOnline))
+        && members.count( pCallback->m_ulSteamID ) ) {
+        pending.push_back( pCallback->m_ulSteamID );
+    }
+}
+
+// Layout Implementation
+
+LayoutNode& Layout::Add( eWidget id, eWidget parent ) {
+    // Every widget appears at most once, so references handed out here stay valid
+    if ( nodes.empty() ) {
+        nodes.reserve( WIDGET_COUNT );
+    }
+    nodes.push_back( LayoutNode {} );
+    nodes.back().id = id;
+    nodes.back().parent = parent;
+    slots[id] = static_cast<int16_t>( nodes.size() );
+    dirty = true;
+    return nodes.back();
+}
+
+void Layout::Update() {
+    if ( GetScreenWidth() != width || GetScreenHeight() != height ) {
+        dirty = true;
+    }
+    if ( dirty ) {
+        Compute();
+    }
+}
+
+const Rectangle& Layout::Get( eWidget id ) {
+    static const Rectangle none = { 0, 0, 0, 0 };
+    if ( dirty ) {
+        Compute();
+    }
+    return slots[id] ? nodes[slots[id] - 1].bounds : none;
+}
+
+void Layout::Resize( eWidget id, float w_px, float h_px ) {
+    if ( !slots[id] ) {
+        return;
+    }
+    LayoutNode& node = nodes[slots[id] - 1];
+    if ( node.w_px != w_px || node.h_px != h_px ) {
+        node.w_px = w_px;
+        node.h_px = h_px;
+        dirty = true;
+    }
+}
+
+void Layout::SetVisible( eWidget id, bool visible ) {
+    if ( slots[id] ) {
+        nodes[slots[id] - 1].visible = visible;
+    }
+}
+
+eWidget Layout::HitTest( Vector2 point ) {
+    if ( dirty ) {
+        Compute();
+    }
+    for ( size_t i = nodes.size(); i-- > 0; ) {
+        if ( nodes[i].visible && CheckCollisionPointRec( point, nodes[i].bounds ) ) {
+            return nodes[i].id;
+        }
+    }
+    return W_ROOT;
+}
+
+void Layout::Compute() {
+    width = GetScreenWidth();
+    height = GetScreenHeight();
+    Rectangle root = { 0, 0, static_cast<float>( width ), static_cast<float>( height ) };
+
+    for ( LayoutNode& node : nodes ) {
+        const Rectangle& parent = node.parent == W_ROOT ? root : nodes[slots[node.parent] - 1].bounds;
+
+        float w = parent.width * node.w_frac + node.w_px;
+        float h = parent.height * node.h_frac + node.h_px;
+        if ( node.w_max > 0 ) w = MIN( w, node.w_max );
+        if ( node.h_max > 0 ) h = MIN( h, node.h_max );
+
+        node.bounds.x = parent.x + (parent.width - w) * node.align_x + node.dx;
+        node.bounds.y = parent.y + (parent.height - h) * node.align_y + node.dy;
+        node.bounds.width = w;
+        node.bounds.height = h;
+
+        if ( node.above != W_ROOT ) {
+            float limit = nodes[slots[node.above] - 1].bounds.y;
+            if ( node.bounds.y + node.bounds.height > limit ) {
+                node.bounds.height = limit > node.bounds.y ? limit - node.bounds.y : 0;
+            }
+        }
+    }
+    dirty = false;
+}
+
+void Layout::BuildScreens() {
+    Layout& loading = screen_layouts[eScreenState::LOADING];
+    LayoutNode& loading_text = loading.Add( W_LOADING_TEXT );
+    loading_text.dx = 100;
+    loading_text.dy = 100;
+
+    Layout& outside = screen_layouts[eScreenState::OUTSIDE_LOBBY];
+    const eWidget outside_buttons[] = { W_OUTSIDE_CREATE, W_OUTSIDE_JOIN, W_OUTSIDE_BROWSE, W_OUTSIDE_QUIT, W_OUTSIDE_BACK };
+    for ( int i = 0; i < 5; i++ ) {
+        LayoutNode& button = outside.Add( outside_buttons[i] );
+        button.w_px = 300;
+        button.h_px = 50;
+        button.dy = i * 100;
+    }
+
+    // Lobby creation and joining share a centred text box with the button under it
+    for ( eScreenState state : { eScreenState::LOBBY_CREATION, eScreenState::LOBBY_JOIN } ) {
+        Layout& form = screen_layouts[state];
+        LayoutNode& textbox = form.Add( W_FORM_TEXTBOX );
+        textbox.w_frac = 0.3;
+        textbox.h_frac = 0.1;
+        textbox.h_max = 30;
+        textbox.align_x = textbox.align_y = 0.5;
+
+        LayoutNode& button = form.Add( W_FORM_BUTTON );
+        button = textbox;
+        button.id = W_FORM_BUTTON;
+        button.dy = 100;
+    }
+
+    Layout& lobby = screen_layouts[eScreenState::LOBBY];
+    LayoutNode& members = lobby.Add( W_LOBBY_MEMBERS );
+    members.w_frac = 0.2;
+    members.h_frac = 1;
+
+    LayoutNode& member_filter = lobby.Add( W_LOBBY_MEMBER_FILTER, W_LOBBY_MEMBERS );
+    member_filter.w_frac = 1;
+    member_filter.w_px = -80;
+    member_filter.h_px = 24;
+    member_filter.dx = 10;
+    member_filter.dy = 30;
+
+    LayoutNode& member_sort = lobby.Add( W_LOBBY_MEMBER_SORT, W_LOBBY_MEMBERS );
+    member_sort.w_px = 55;
+    member_sort.h_px = 24;
+    member_sort.align_x = 1;
+    member_sort.dx = -10;
+    member_sort.dy = 30;
+
+    LayoutNode& member_list = lobby.Add( W_LOBBY_MEMBER_LIST, W_LOBBY_MEMBERS );
+    member_list.w_frac = member_list.h_frac = 1;
+    member_list.w_px = -20;
+    member_list.h_px = -60;
+    member_list.dx = 10;
+    member_list.dy = 60;
+
+    LayoutNode& chat = lobby.Add( W_LOBBY_CHAT );
+    chat.w_frac = 0.8;
+    chat.h_frac = 1;
+    chat.align_x = 1;
+
+    // Height comes from the chat input every frame, see Resize
+    LayoutNode& chat_box = lobby.Add( W_LOBBY_CHAT_BOX, W_LOBBY_CHAT );
+    chat_box.w_frac = 1;
+    chat_box.align_y = 1;
+
+    // One line riding on top of the chat box, whatever its height
+    LayoutNode& typing = lobby.Add( W_LOBBY_TYPING, W_LOBBY_CHAT_BOX );
+    typing.w_frac = 1;
+    typing.w_px = -40;
+    typing.h_px = 16;
+    typing.dx = 20;
+    typing.dy = -18;
+
+    LayoutNode& message_list = lobby.Add( W_LOBBY_MESSAGE_LIST, W_LOBBY_CHAT );
+    message_list.w_frac = message_list.h_frac = 1;
+    message_list.w_px = -40;
+    message_list.h_px = -70;
+    message_list.dx = 20;
+    message_list.dy = 70;
+    message_list.above = W_LOBBY_TYPING;
+
+    LayoutNode& jump_box = lobby.Add( W_LOBBY_JUMP_BOX, W_LOBBY_CHAT );
+    jump_box.w_px = 160;
+    jump_box.h_px = 24;
+    jump_box.align_x = 1;
+    jump_box.dx = -10;
+    jump_box.dy = 30;
+
+    LayoutNode& unread_button = lobby.Add( W_LOBBY_UNREAD_BUTTON, W_LOBBY_JUMP_BOX );
+    unread_button.w_px = 120;
+    unread_button.h_frac = 1;
+    unread_button.dx = -130;
+
+    // Whatever the jump box and unread button leave of the row
+    LayoutNode& tabs = lobby.Add( W_LOBBY_TABS, W_LOBBY_CHAT );
+    tabs.w_frac = 1;
+    tabs.w_px = -310;
+    tabs.h_px = 24;
+    tabs.dx = 10;
+    tabs.dy = 30;
+
+    LayoutNode& diagnostics_panel = lobby.Add( W_LOBBY_DIAGNOSTICS );
+    diagnostics_panel.w_frac = 0.4;
+    diagnostics_panel.h_frac = 1;
+    diagnostics_panel.align_x = 1;
+    diagnostics_panel.above = W_LOBBY_CHAT_BOX;
+    diagnostics_panel.visible = false;
+
+    Layout& browser = screen_layouts[eScreenState::LOBBY_BROWSER];
+    LayoutNode& back = browser.Add( W_BROWSER_BACK );
+    back.w_px = 80;
+    back.h_px = 24;
+    back.dx = back.dy = 10;
+
+    LayoutNode& filter = browser.Add( W_BROWSER_FILTER );
+    filter.w_frac = 0.4;
+    filter.h_px = 24;
+    filter.dx = 100;
+    filter.dy = 10;
+
+    // Right of the filter box, the label is drawn past the box itself
+    LayoutNode& free_slots = browser.Add( W_BROWSER_FREE_SLOTS, W_BROWSER_FILTER );
+    free_slots.w_px = free_slots.h_px = 24;
+    free_slots.align_x = 1;
+    free_slots.dx = 34;
+
+    LayoutNode& refresh = browser.Add( W_BROWSER_REFRESH );
+    refresh.w_px = 100;
+    refresh.h_px = 24;
+    refresh.align_x = 1;
+    refresh.dx = -10;
+    refresh.dy = 10;
+
+    LayoutNode& list = browser.Add( W_BROWSER_LIST );
+    list.w_frac = list.h_frac = 1;
+    list.w_px = -20;
+    list.h_px = -88;
+    list.dx = 10;
+    list.dy = 44;
+
+    LayoutNode& prev = browser.Add( W_BROWSER_PREV );
+    prev.w_px = 80;
+    prev.h_px = 24;
+    prev.align_y = 1;
+    prev.dx = 10;
+    prev.dy = -10;
+
+    LayoutNode& status = browser.Add( W_BROWSER_STATUS );
+    status.w_frac = 1;
+    status.w_px = -200;
+    status.h_px = 24;
+    status.align_y = 1;
+    status.dx = 100;
+    status.dy = -10;
+
+    LayoutNode& next = browser.Add( W_BROWSER_NEXT );
+    next.w_px = 80;
+    next.h_px = 24;
+    next.align_x = next.align_y = 1;
+    next.dx = next.dy = -10;
+}
+
+// Diagnostics Implementation
+
+void Diagnostics::Clear() {
+    peers.clear();
+    last_poll = 0;
+}
+
+void Diagnostics::Listen() {
+    listen_socket = SteamNetworkingSockets()->CreateListenSocketP2P( DIAG_VIRTUAL_PORT, 0, NULL );
+    if ( listen_socket == k_HSteamListenSocket_Invalid ) {
+        TraceLog( LOG_WARNING, "No listen socket for diagnostics probes" );
+    }
+}
+
+void Diagnostics::Drop( uint64 peer ) {
+    auto it = probes.find( peer );
+    if ( it == probes.end() ) {
+        return;
+    }
+    SteamNetworkingSockets()->CloseConnection( it->second, 0, NULL, false );
+    probes.erase( it );
+}
+
+void Diagnostics::Poll() {
+    double now = GetTime();
+    if ( now - last_poll < DIAG_POLL_INTERVAL ) {
+        return;
+    }
+    last_poll = now;
+
+    relay_status = SteamNetworkingUtils()->GetRelayNetworkStatus( NULL );
+
+    for ( auto it = probes.begin(); it != probes.end(); ) {
+        if ( !session_manager.Shares( it->first ) ) {
+            SteamNetworkingSockets()->CloseConnection( it->second, 0, NULL, false );
+            it = probes.erase( it );
+        } else {
+            ++it;
+        }
+    }
+
+    if ( visible ) {
+        uint64 self = SteamUser()->GetSteamID().ConvertToUint64();
+        for ( uint64 member : lobby_manager.members ) {
+            if ( probes.size() >= DIAG_MAX_PEERS ) {
+                break;
+            }
+            if ( member == self || probes.count( member ) != 0 ) {
+                continue;
+            }
+            SteamNetworkingIdentity identity;
+            identity.SetSteamID64( member );
+            HSteamNetConnection conn = SteamNetworkingSockets()->ConnectP2P( identity, DIAG_VIRTUAL_PORT, 0, NULL );
+            if ( conn != k_HSteamNetConnection_Invalid ) {
+                probes[member] = conn;
+            }
+        }
+    }
+
+    // Probes are never configured with more than the default lane
+    SteamNetConnectionRealTimeStatus_t status;
+    SteamNetConnectionRealTimeLaneStatus_t lanes[1];
+    int lane_count = 1;
+
+    for ( auto& [member, conn] : probes ) {
+        PeerDiagnostics& peer = peers[member];
+        peer.name = SteamFriends()->GetFriendPersonaName( member );
+
+        EResult res = SteamNetworkingSockets()->GetConnectionRealTimeStatus( conn, &status, lane_count, lanes );
+        if ( res != k_EResultOK ) {
+            peer.state = k_ESteamNetworkingConnectionState_None;
+            continue;
+        }
+        peer.state = status.m_eState;
+        if ( status.m_eState != k_ESteamNetworkingConnectionState_Connected ) {
+            continue;
+        }
+
+        ConnectionSample sample = {};
+        sample.ping_ms = static_cast<int16>( MIN( status.m_nPing, 32767 ) );
+        sample.quality_local = status.m_flConnectionQualityLocal < 0 ? 255 : static_cast<uint8>( status.m_flConnectionQualityLocal * 100 );
+        sample.quality_remote = status.m_flConnectionQualityRemote < 0 ? 255 : static_cast<uint8>( status.m_flConnectionQualityRemote * 100 );
+        sample.send_rate = status.m_nSendRateBytesPerSecond;
+        sample.out_bytes_per_sec = static_cast<int32>( status.m_flOutBytesPerSec );
+        sample.in_bytes_per_sec = static_cast<int32>( status.m_flInBytesPerSec );
+        sample.pending_reliable = status.m_cbPendingReliable;
+        sample.pending_unreliable = status.m_cbPendingUnreliable;
+        sample.lane_count = static_cast<uint8>( lane_count );
+        for ( int i = 0; i < lane_count; i++ ) {
+            sample.lanes[i].pending_reliable = lanes[i].m_cbPendingReliable;
+            sample.lanes[i].pending_unreliable = lanes[i].m_cbPendingUnreliable;
+            sample.lanes[i].queue_time_us = static_cast<int32>( lanes[i].m_usecQueueTime );
+        }
+        peer.history.push( sample );
+    }
+
+    // Drop peers whose probe went away since the last poll
+    for ( auto it = peers.begin(); it != peers.end(); ) {
+        if ( probes.count( it->first ) == 0 ) {
+            it = peers.erase( it );
+        } else {
+            ++it;
+        }
+    }
+}
+
+void Diagnostics::OnConnectionStatusChanged( SteamNetConnectionStatusChangedCallback_t* pCallback ) {
+    const SteamNetConnectionInfo_t& info = pCallback->m_info;
+    uint64 peer = info.m_identityRemote.GetSteamID64();
+    auto it = probes.find( peer );
+    bool ours = it != probes.end() && it->second == pCallback->m_hConn;
+
+    switch ( info.m_eState ) {
+        case k_ESteamNetworkingConnectionState_Connecting: {
+            if ( info.m_hListenSocket != listen_socket || listen_socket == k_HSteamListenSocket_Invalid ) {
+                return; // one we dialled, or not a probe at all
+            }
+            if ( !session_manager.Shares( peer ) ) {
+                SteamNetworkingSockets()->CloseConnection( pCallback->m_hConn, 0, NULL, false );
+                return;
+            }
+            // Both ends dialled at once: the lower id's dial wins on both sides
+            if ( it != probes.end() ) {
+                if ( peer > SteamUser()->GetSteamID().ConvertToUint64() ) {
+                    SteamNetworkingSockets()->CloseConnection( pCallback->m_hConn, 0, NULL, false );
+                    return;
+                }
+                Drop( peer );
+            }
+            if ( SteamNetworkingSockets()->AcceptConnection( pCallback->m_hConn ) == k_EResultOK ) {
+                probes[peer] = pCallback->m_hConn;
+            } else {
+                SteamNetworkingSockets()->CloseConnection( pCallback->m_hConn, 0, NULL, false );
+            }
+            break;
+        }
+        case k_ESteamNetworkingConnectionState_ClosedByPeer:
+        case k_ESteamNetworkingConnectionState_ProblemDetectedLocally:
+            SteamNetworkingSockets()->CloseConnection( pCallback->m_hConn, 0, NULL, false );
+            if ( ours ) {
+                probes.erase( it );
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+void Diagnostics::Render( Rectangle bounds ) {
+    const char* relay_text = "unknown";
+    switch ( relay_status ) {
+        case k_ESteamNetworkingAvailability_Current:    relay_text = "ok"; break;
+        case k_ESteamNetworkingAvailability_Attempting: relay_text = "connecting"; break;
+        case k_ESteamNetworkingAvailability_Waiting:    relay_text = "waiting"; break;
+        case k_ESteamNetworkingAvailability_Retrying:   relay_text = "retrying"; break;
+        case k_ESteamNetworkingAvailability_Failed:
+        case k_ESteamNetworkingAvailability_CannotTry:  relay_text = "failed"; break;
+        default: break;
+    }
+
+    GuiPanel( bounds, TextFormat( "Diagnostics (F3) - Relay: %s", relay_text ) );
+
+    float font_size = 10;
+    float line_height = 12;
+    float graph_height = 30;
+    float x = bounds.x + 10;
+    float y = bounds.y + 34;
+
+    if ( peers.empty() ) {
+        text_renderer.Queue( "No peer connections", Vector2 { x, y }, font_size, GRAY );
+        text_renderer.Flush();
+        return;
+    }
+
+    for ( auto& [member, peer] : peers ) {
+        if ( y + 4 * line_height + graph_height > bounds.y + bounds.height ) {
+            break;
+        }
+
+        const char* username = peer.name.c_str();
+        if ( peer.history.empty() ) {
+            const char* state = peer.state == k_ESteamNetworkingConnectionState_Connected ? "no data" : "connecting";
+            text_renderer.Queue( TextFormat( "%s: %s", username, state ), Vector2 { x, y }, font_size, GRAY );
+            y += line_height * 2;
+            continue;
+        }
+
+        const ConnectionSample& s = peer.history.back();
+        text_renderer.Queue( TextFormat( "%s  ping %dms  quality %d%% / %d%%", username, s.ping_ms,
+                                         s.quality_local == 255 ? -1 : s.quality_local,
+                                         s.quality_remote == 255 ? -1 : s.quality_remote ), Vector2 { x, y }, font_size, BLACK );
+        y += line_height;
+        text_renderer.Queue( TextFormat( "rate %d B/s  out %d B/s  in %d B/s", s.send_rate, s.out_bytes_per_sec, s.in_bytes_per_sec ), Vector2 { x, y }, font_size, DARKGRAY );
+        y += line_height;
+        text_renderer.Queue( TextFormat( "pending rel %d B  unrel %d B", s.pending_reliable, s.pending_unreliable ), Vector2 { x, y }, font_size, DARKGRAY );
+        y += line_height;
+        for ( int i = 0; i < s.lane_count; i++ ) {
+            text_renderer.Queue( TextFormat( "lane %d: rel %d B  unrel %d B  queue %.1fms", i,
+                                             s.lanes[i].pending_reliable, s.lanes[i].pending_unreliable,
+                                             s.lanes[i].queue_time_us / 1000.0f ), Vector2 { x + 10, y }, font_size, DARKGRAY );
+            y += line_height;
+        }
+
+        // Ping over the kept history, scaled to the worst ping seen
+        int max_ping = 1;
+        for ( size_t i = 0; i < peer.history.size(); i++ ) {
+            max_ping = peer.history[i].ping_ms > max_ping ? peer.history[i].ping_ms : max_ping;
+        }
+        float graph_width = bounds.width - 20;
+        float step = graph_width / DIAG_HISTORY_SIZE;
+        DrawRectangleLinesEx( Rectangle { x, y, graph_width, graph_height }, 1, LIGHTGRAY );
+        for ( size_t i = 1; i < peer.history.size(); i++ ) {
+            Vector2 a = { x + (i - 1) * step, y + graph_height - graph_height * peer.history[i - 1].ping_ms / max_ping };
+            Vector2 b = { x + i * step, y + graph_height - graph_height * peer.history[i].ping_ms / max_ping };
+            DrawLineV( a, b, BLUE );
+        }
+        y += graph_height + line_height;
+    }
+
+    // Names can be any script, so they go through the shaped font like the rest of the UI
+    text_renderer.Flush();
+}
+
+// Tracer Implementation
+
+uint64 Tracer::Now() {
+    using namespace std::chrono;
+    return duration_cast<microseconds>( steady_clock::now().time_since_epoch() ).count();
+}
+
+// Same text on both ends gives the same id, which is what links the flow events together
+uint64 Tracer::FlowId( const char* text, size_t len ) {
+    return HashBytes( text, len );
+}
+
+TraceBuffer* Tracer::ThreadBuffer() {
+    thread_local TraceBuffer* buffer = nullptr;
+    if ( buffer == nullptr ) {
+        std::lock_guard<std::mutex> lock( registry_mutex );
+        buffers.push_back( std::make_unique<TraceBuffer>() );
+        buffer = buffers.back().get();
+        buffer->tid = static_cast<uint32>( buffers.size() );
+    }
+    return buffer;
+}
+
+void Tracer::Push( const TraceEvent& event ) {
+    TraceBuffer* buffer = ThreadBuffer();
+    size_t i = buffer->count.load( std::memory_order_relaxed );
+    if ( i >= TRACE_BUFFER_EVENTS ) {
+        buffer->dropped++;
+        return;
+    }
+    buffer->events[i] = event;
+    buffer->count.store( i + 1, std::memory_order_release );
+}
+
+void Tracer::Span( const char* name, const char* category, uint64 start_us, uint64 end_us ) {
+    Push( TraceEvent { name, category, 'X', start_us, end_us - start_us, 0 } );
+}
+
+void Tracer::Flow( const char* name, char phase, uint64 id ) {
+    Push( TraceEvent { name, "flow", phase, Now(), 0, id } );
+}
+
+bool Tracer::Dump( const char* path ) {
+    FILE* file = fopen( path, "w" );
+    if ( file == NULL ) {
+        TraceLog( LOG_ERROR, "Couldn't open %s for writing", path );
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock( registry_mutex );
+    size_t total = 0;
+    bool first = true;
+    fprintf( file, "{\"traceEvents\":[\n" );
+    for ( auto& buffer : buffers ) {
+        size_t count = buffer->count.load( std::memory_order_acquire );
+        for ( size_t i = 0; i < count; i++ ) {
+            const TraceEvent& e = buffer->events[i];
+            fprintf( file, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":1,\"tid\":%u",
+                     first ? "" : ",\n", e.name, e.category, e.phase,
+                     (unsigned long long) e.ts_us, buffer->tid );
+            if ( e.phase == 'X' ) {
+                fprintf( file, ",\"dur\":%llu", (unsigned long long) e.dur_us );
+            } else {
+                // Bind flow events to the enclosing span, so the arrows attach to callbacks
+                fprintf( file, ",\"id\":\"0x%llx\",\"bp\":\"e\"", (unsigned long long) e.id );
+            }
+            fprintf( file, "}" );
+            first = false;
+        }
+        total += count;
+        if ( buffer->dropped > 0 ) {
+            TraceLog( LOG_WARNING, "Trace buffer of thread %u dropped %zu events", buffer->tid, buffer->dropped );
+        }
+    }
+    fprintf( file, "\n]}\n" );
+    fclose( file );
+
+    TraceLog( LOG_INFO, "Wrote %zu trace events to %s", total, path );
+    return true;
+}
+
+// Recorder Implementation
+
+bool CallbackRecorder::Open( const char* path ) {
+    file = fopen( path, "wb" );
+    if ( file == NULL ) {
+        TraceLog( LOG_ERROR, "Couldn't open %s for recording", path );
+        return false;
+    }
+
+    fwrite( RECORDING_MAGIC, 1, 4, file );
+    fputc( RECORDING_VERSION, file );
+    last_us = Tracer::Now();
+
+    TraceLog( LOG_INFO, "Recording lobby callbacks to %s", path );
+    return true;
+}
+
+void CallbackRecorder::Close() {
+    if ( file != NULL ) {
+        fclose( file );
+        file = NULL;
+    }
+}
+
+void CallbackRecorder::WriteVarint( uint64 value ) {
+    while ( value >= 0x80 ) {
+        fputc( static_cast<int>( (value & 0x7F) | 0x80 ), file );
+        value >>= 7;
+    }
+    fputc( static_cast<int>( value ), file );
+}
+
+void CallbackRecorder::WriteU64( uint64 value ) {
+    uint8 bytes[8];
+    for ( int i = 0; i < 8; i++ ) {
+        bytes[i] = static_cast<uint8>( value >> (8 * i) );
+    }
+    fwrite( bytes, 1, 8, file );
+}
+
+void CallbackRecorder::WriteHeader( uint8 type ) {
+    uint64 now = Tracer::Now();
+    fputc( type, file );
+    WriteVarint( now - last_us );
+    last_us = now;
+}
+
+void CallbackRecorder::RecordChatMsg( const LobbyChatMsg_t* msg, const char* data, int size ) {
+    WriteHeader( RECORD_CHAT_MSG );
+    WriteU64( msg->m_ulSteamIDLobby );
+    WriteU64( msg->m_ulSteamIDUser );
+    fputc( msg->m_eChatEntryType, file );
+    WriteVarint( msg->m_iChatID );
+    WriteVarint( size );
+    fwrite( data, 1, size, file );
+}
+
+void CallbackRecorder::RecordChatUpdate( const LobbyChatUpdate_t* update ) {
+    WriteHeader( RECORD_CHAT_UPDATE );
+    WriteU64( update->m_ulSteamIDLobby );
+    WriteU64( update->m_ulSteamIDUserChanged );
+    WriteU64( update->m_ulSteamIDMakingChange );
+    WriteVarint( update->m_rgfChatMemberStateChange );
+}
+
+// Replayer Implementation
+
+// Reads from the in memory copy of the recording, flags `ok` false once it runs past the end
+struct RecordingReader {
+    const uint8* data;
+    size_t size;
+    size_t pos = 0;
+    bool ok = true;
+
+    uint8 ReadU8() {
+        if ( pos >= size ) { ok = false; return 0; }
+        return data[pos++];
+    }
+
+    uint64 ReadU64() {
+        uint64 value = 0;
+        for ( int i = 0; i < 8; i++ ) {
+            value |= static_cast<uint64>( ReadU8() ) << (8 * i);
+        }
+        return value;
+    }
+
+    uint64 ReadVarint() {
+        uint64 value = 0;
+        for ( int shift = 0; shift < 64 && ok; shift += 7 ) {
+            uint8 byte = ReadU8();
+            value |= static_cast<uint64>( byte & 0x7F ) << shift;
+            if ( (byte & 0x80) == 0 ) break;
+        }
+        return value;
+    }
+
+    const char* ReadBytes( size_t count ) {
+        if ( count > size - pos ) { ok = false; return NULL; }
+        const char* bytes = reinterpret_cast<const char*>( data + pos );
+        pos += count;
+        return bytes;
+    }
+};
+
+int CallbackReplayer::Run( const char* path, bool max_speed ) {
+    int file_size = 0;
+    unsigned char* file_data = LoadFileData( path, &file_size );
+    if ( file_data == NULL ) {
+        TraceLog( LOG_ERROR, "Couldn't read recording %s", path );
+        return EXIT_FAILURE;
+    }
+
+    RecordingReader reader { file_data, static_cast<size_t>( file_size ) };
+    const char* magic = reader.ReadBytes( 4 );
+    if ( magic == NULL || memcmp( magic, RECORDING_MAGIC, 4 ) != 0 || reader.ReadU8() != RECORDING_VERSION ) {
+        TraceLog( LOG_ERROR, "%s is not a callback recording", path );
+        UnloadFileData( file_data );
+        return EXIT_FAILURE;
+    }
+
+    size_t chat_msgs = 0, chat_updates = 0, bytes = 0;
+    uint64 handler_us = 0;
+    uint64 start = Tracer::Now();
+    uint64 due = start;
+
+    while ( reader.pos < reader.size && reader.ok ) {
+        uint8 type = reader.ReadU8();
+        due += reader.ReadVarint();
+
+        if ( !max_speed ) {
+            uint64 now = Tracer::Now();
+            if ( due > now ) {
+                std::this_thread::sleep_for( std::chrono::microseconds( due - now ) );
+            }
+        }
+
+        if ( type == RECORD_CHAT_MSG ) {
+            uint64 lobby = reader.ReadU64();
+            uint64 sender = reader.ReadU64();
+            reader.ReadU8(); // chat entry type
+            reader.ReadVarint(); // chat id
+            size_t size = reader.ReadVarint();
+            const char* entry = reader.ReadBytes( size );
+            if ( !reader.ok ) break;
+
+            lobby_manager.id = lobby;
+            uint64 t = Tracer::Now();
+            {
+                TRACE_SCOPE( "OnLobbyMessageRecieved", "callback" );
+                lobby_manager.HandleChatEntry( sender, entry, static_cast<int>( size ) );
+            }
+            handler_us += Tracer::Now() - t;
+            chat_msgs++;
+            bytes += size;
+        } else if ( type == RECORD_CHAT_UPDATE ) {
+            uint64 lobby = reader.ReadU64();
+            uint64 member = reader.ReadU64();
+            reader.ReadU64(); // member making the change
+            uint32 state_change = static_cast<uint32>( reader.ReadVarint() );
+            if ( !reader.ok ) break;
+
+            lobby_manager.id = lobby;
+            uint64 t = Tracer::Now();
+            {
+                TRACE_SCOPE( "OnLobbyDataUpdate", "callback" );
+                lobby_manager.HandleMemberChange( member, state_change );
+            }
+            handler_us += Tracer::Now() - t;
+            chat_updates++;
+        } else {
+            TraceLog( LOG_ERROR, "Unknown record type %d at offset %zu", type, reader.pos - 1 );
+            reader.ok = false;
+        }
+    }
+
+    UnloadFileData( file_data );
+    if ( !reader.ok ) {
+        TraceLog( LOG_ERROR, "Recording %s is truncated or corrupt", path );
+    }
+
+    double seconds = (Tracer::Now() - start) / 1e6;
+    size_t events = chat_msgs + chat_updates;
+    TraceLog( LOG_INFO, "Replayed %zu chat messages (%zu bytes) and %zu member updates in %.3fs",
+              chat_msgs, bytes, chat_updates, seconds );
+    TraceLog( LOG_INFO, "Handlers: %.3fms total, %.3fus / event, %.0f events / s",
+              handler_us / 1e3, events ? (double) handler_us / events : 0.0,
+              seconds > 0 ? events / seconds : 0.0 );
+    TraceLog( LOG_INFO, "History: %zu messages, %zu members", lobby_manager.messages.size(), lobby_manager.members.size() );
+
+    return reader.ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// Network Benchmark Implementation
+
+static const ImpairmentProfile impairment_profiles[] = {
+    // name          loss %  lag ms  reorder %  reorder ms  rate limit
+    { "clean",       0,      0,      0,         0,          0 },
+    { "lan",         0,      2,      0,         0,          0 },
+    { "broadband",   0.5f,   30,     0.5f,      5,          0 },
+    { "wifi",        2,      40,     2,         15,         0 },
+    { "mobile",      5,      120,    5,         40,         256 * 1024 },
+    { "congested",   10,     200,    10,        80,         32 * 1024 },
+};
+
+void NetworkBenchmark::ApplyProfile( const ImpairmentProfile& profile ) {
+    ISteamNetworkingUtils* utils = SteamNetworkingUtils();
+    utils->SetGlobalConfigValueFloat( k_ESteamNetworkingConfig_FakePacketLoss_Send, profile.loss_pct );
+    utils->SetGlobalConfigValueFloat( k_ESteamNetworkingConfig_FakePacketLoss_Recv, 0 );
+    utils->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_FakePacketLag_Send, profile.lag_ms );
+    utils->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_FakePacketLag_Recv, 0 );
+    utils->SetGlobalConfigValueFloat( k_ESteamNetworkingConfig_FakePacketReorder_Send, profile.reorder_pct );
+    utils->SetGlobalConfigValueFloat( k_ESteamNetworkingConfig_FakePacketReorder_Recv, 0 );
+    utils->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_FakePacketReorder_Time, profile.reorder_ms );
+    utils->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_FakeRateLimit_Send_Rate, profile.rate_limit );
+    utils->SetGlobalConfigValueInt32( k_ESteamNetworkingConfig_FakeRateLimit_Send_Burst, profile.rate_limit / 4 );
+}
+
+bool NetworkBenchmark::RunProfile( const ImpairmentProfile& profile, ImpairmentResult& result ) {
+    ApplyProfile( profile );
+
+    ISteamNetworkingSockets* sockets = SteamNetworkingSockets();
+    HSteamNetConnection sender, receiver;
+    if ( !sockets->CreateSocketPair( &sender, &receiver, true, NULL, NULL ) ) {
+        TraceLog( LOG_ERROR, "CreateSocketPair failed for profile %s", profile.name );
+        return false;
+    }
+
+    // Each message carries its send time, the text around it is sized like real chat
+    struct Header { uint64 sent_us; uint32 seq; };
+    char payload[MAX_CHATMSG_SIZE];
+    uint32 seed = 12345;
+
+    size_t sent = 0;
+    uint64 start = Tracer::Now();
+    uint64 last_sample = start;
+    result.latencies_us.reserve( BENCH_MESSAGES );
+
+    while ( result.delivered < BENCH_MESSAGES ) {
+        uint64 now = Tracer::Now();
+        if ( (now - start) / 1e6 > BENCH_TIMEOUT ) {
+            TraceLog( LOG_WARNING, "Profile %s timed out with %zu / %d delivered", profile.name, result.delivered, BENCH_MESSAGES );
+            break;
+        }
+
+        size_t due = MIN( static_cast<size_t>( (now - start) * BENCH_MESSAGES_PER_SEC / 1000000 ) + 1, static_cast<size_t>( BENCH_MESSAGES ) );
+        for ( ; sent < due; sent++ ) {
+            seed = seed * 1103515245 + 12345;
+            int text_size = 20 + (seed >> 16) % 400;
+            Header header = { Tracer::Now(), static_cast<uint32>( sent ) };
+            memcpy( payload, &header, sizeof( header ) );
+            int len = sizeof( header ) + snprintf( payload + sizeof( header ), sizeof( payload ) - sizeof( header ), "[bench]: %0*d", text_size, 0 );
+            sockets->SendMessageToConnection( sender, payload, len, k_nSteamNetworkingSend_Reliable, NULL );
+        }
+
+        SteamAPI_RunCallbacks();
+
+        SteamNetworkingMessage_t* msgs[64];
+        int count;
+        while ( (count = sockets->ReceiveMessagesOnConnection( receiver, msgs, 64 )) > 0 ) {
+            uint64 received = Tracer::Now();
+            for ( int i = 0; i < count; i++ ) {
+                Header header;
+                memcpy( &header, msgs[i]->m_pData, sizeof( header ) );
+                result.latencies_us.push_back( static_cast<uint32>( received - header.sent_us ) );
+                result.payload_bytes += msgs[i]->m_cbSize;
+                result.delivered++;
+                msgs[i]->Release();
+            }
+        }
+
+        now = Tracer::Now();
+        if ( now - last_sample >= 100000 ) {
+            SteamNetConnectionRealTimeStatus_t status;
+            if ( sockets->GetConnectionRealTimeStatus( sender, &status, 0, NULL ) == k_EResultOK ) {
+                result.wire_bytes += status.m_flOutBytesPerSec * (now - last_sample) / 1e6;
+            }
+            last_sample = now;
+        }
+
+        std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+    }
+
+    result.seconds = (Tracer::Now() - start) / 1e6;
+    sockets->CloseConnection( sender, 0, NULL, false );
+    sockets->CloseConnection( receiver, 0, NULL, false );
+    return true;
+}
+
+int NetworkBenchmark::Run() {
+    SteamNetworkingUtils()->InitRelayNetworkAccess();
+
+    printf( "%-10s %10s %10s %10s %10s %12s %10s\n", "profile", "delivered", "p50 ms", "p99 ms", "max ms", "goodput KB/s", "overhead" );
+    for ( const ImpairmentProfile& profile : impairment_profiles ) {
+        ImpairmentResult result;
+        if ( !RunProfile( profile, result ) ) {
+            continue;
+        }
+
+        std::vector<uint32>& lat = result.latencies_us;
+        std::sort( lat.begin(), lat.end() );
+        auto percentile = [&]( double p ) {
+            return lat.empty() ? 0.0 : lat[static_cast<size_t>( p * (lat.size() - 1) )] / 1000.0;
+        };
+
+        // Bytes on the wire per payload byte, resends and packet headers push this above 1
+        double overhead = result.payload_bytes ? result.wire_bytes / result.payload_bytes : 0.0;
+        printf( "%-10s %10zu %10.2f %10.2f %10.2f %12.1f %9.2fx\n", profile.name, result.delivered,
+                percentile( 0.5 ), percentile( 0.99 ), percentile( 1.0 ),
+                result.payload_bytes / 1024.0 / result.seconds, overhead );
+    }
+
+    ApplyProfile( impairment_profiles[0] );
+    return EXIT_SUCCESS;
+}
+
+// Metrics Implementation
+
+size_t MetricsThreadShard() {
+    static std::atomic<size_t> next_shard { 0 };
+    thread_local size_t shard = next_shard.fetch_add( 1 ) % METRICS_SHARDS;
+    return shard;
+}
+
+uint64 Counter::Value() const {
+    uint64 total = 0;
+    for ( const Shard& shard : shards ) {
+        total += shard.value.load( std::memory_order_relaxed );
+    }
+    return total;
+}
+
+// Index of the highest set bit, `v` isn't 0
+static int HighestSetBit( uint64 v ) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+#ifdef _WIN64
+    _BitScanReverse64( &index, v );
+#else
+    if ( v >> 32 ) {
+        _BitScanReverse( &index, static_cast<unsigned long>( v >> 32 ) );
+        index += 32;
+    } else {
+        _BitScanReverse( &index, static_cast<unsigned long>( v ) );
+    }
+#endif
+    return static_cast<int>( index );
+#else
+    return 63 - __builtin_clzll( v );
+#endif
+}
+
+size_t Histogram::BucketIndex( uint64 v ) {
+    const uint64 sub = 1ull << HISTOGRAM_SUB_BITS;
+    if ( v < sub ) {
+        return v;
+    }
+    if ( v >> HISTOGRAM_MAX_BITS ) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    int msb = HighestSetBit( v );
+    int shift = msb - HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) + ((v >> shift) & (sub - 1));
+}
+
+uint64 Histogram::BucketUpperBound( size_t index ) {
+    const uint64 sub = 1ull << HISTOGRAM_SUB_BITS;
+    if ( index < sub ) {
+        return index;
+    }
+    if ( index == HISTOGRAM_BUCKETS - 1 ) {
+        return UINT64_MAX; // overflow, only ever counted under +Inf
+    }
+    int shift = static_cast<int>( index >> HISTOGRAM_SUB_BITS ) - 1;
+    uint64 lower = (sub + (index & (sub - 1))) << shift;
+    return lower + (1ull << shift) - 1;
+}
+
+void Histogram::Record( uint64 v ) {
+    Shard& shard = shards[MetricsThreadShard()];
+    shard.buckets[BucketIndex( v )].fetch_add( 1, std::memory_order_relaxed );
+    shard.sum.fetch_add( v, std::memory_order_relaxed );
+    shard.count.fetch_add( 1, std::memory_order_relaxed );
+}
+
+void Histogram::Export( std::string& out, const char* name, const char* help ) const {
+    uint64 merged[HISTOGRAM_BUCKETS] = {};
+    uint64 sum = 0, count = 0;
+    for ( const Shard& shard : shards ) {
+        for ( size_t i = 0; i < HISTOGRAM_BUCKETS; i++ ) {
+            merged[i] += shard.buckets[i].load( std::memory_order_relaxed );
+        }
+        sum += shard.sum.load( std::memory_order_relaxed );
+        count += shard.count.load( std::memory_order_relaxed );
+    }
+
+    out += TextFormat( "# HELP %s %s\n# TYPE %s histogram\n", name, help, name );
+
+    // Every power of two boundary is also a bucket boundary, so these sums are exact
+    uint64 cumulative = 0;
+    size_t i = 0;
+    for ( int bit = 0; bit <= HISTOGRAM_MAX_BITS; bit++ ) {
+        uint64 le = (1ull << bit) - 1;
+        for ( ; i < HISTOGRAM_BUCKETS && BucketUpperBound( i ) <= le; i++ ) {
+            cumulative += merged[i];
+        }
+        out += TextFormat( "%s_bucket{le=\"%llu\"} %llu\n", name, (unsigned long long) le, (unsigned long long) cumulative );
+    }
+    out += TextFormat( "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long) count );
+    out += TextFormat( "%s_sum %llu\n%s_count %llu\n", name, (unsigned long long) sum, name, (unsigned long long) count );
+}
+
+static void ExportCounter( std::string& out, const char* name, const char* help, const Counter& counter ) {
+    out += TextFormat( "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", name, help, name, name, (unsigned long long) counter.Value() );
+}
+
+static void ExportGauge( std::string& out, const char* name, const char* help, const Gauge& gauge ) {
+    out += TextFormat( "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", name, help, name, name, (long long) gauge.Value() );
+}
+
+std::string Metrics::Export() const {
+    std::string out;
+    ExportCounter( out, "chatroom_messages_sent_total", "Chat messages sent with SendLobbyChatMsg", messages_sent );
+    ExportCounter( out, "chatroom_messages_received_total", "Chat messages received", messages_received );
+    ExportCounter( out, "chatroom_bytes_sent_total", "Chat payload bytes sent", bytes_sent );
+    ExportCounter( out, "chatroom_bytes_received_total", "Chat payload bytes received", bytes_received );
+    ExportCounter( out, "chatroom_send_failures_total", "SendLobbyChatMsg calls that returned false", send_failures );
+    ExportCounter( out, "chatroom_messages_relayed_total", "Chat entries this client bridged into another shard", messages_relayed );
+    ExportCounter( out, "chatroom_presence_writes_total", "SetLobbyMemberData calls for our typing and idle state", presence_writes );
+    ExportCounter( out, "chatroom_owner_migrations_total", "Times the displayed lobby changed owner", owner_migrations );
+    ExportCounter( out, "chatroom_members_joined_total", "Members that entered the lobby", members_joined );
+    ExportCounter( out, "chatroom_members_left_total", "Members that left, disconnected or got kicked", members_left );
+    ExportGauge( out, "chatroom_history_size", "Messages kept in the lobby history", history_size );
+    ExportGauge( out, "chatroom_members", "Members in the current lobby", members );
+    callback_us.Export( out, "chatroom_callback_duration_us", "Time spent in Steam callback handlers" );
+    frame_us.Export( out, "chatroom_frame_duration_us", "Frame time" );
+    join_first_paint_ms.Export( out, "chatroom_join_first_paint_ms", "From asking to join until the lobby screen is drawn" );
+    join_interactive_ms.Export( out, "chatroom_join_interactive_ms", "From asking to join until entered with lobby data and member names" );
+    return out;
+}
+
+bool MetricsExporter::Start() {
+    if ( http_port == 0 ) {
+        return true;
+    }
+
+#ifndef _WIN32
+    listen_fd = socket( AF_INET, SOCK_STREAM, 0 );
+    int reuse = 1;
+    setsockopt( listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof( reuse ) );
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons( http_port );
+    addr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+
+    if ( listen_fd < 0 || bind( listen_fd, (sockaddr*) &addr, sizeof( addr ) ) != 0 || listen( listen_fd, 4 ) != 0 ) {
+        TraceLog( LOG_ERROR, "Couldn't listen for metrics on 127.0.0.1:%d", http_port );
+        if ( listen_fd >= 0 ) close( listen_fd );
+        listen_fd = -1;
+        return false;
+    }
+
+    Publish();
+    http_thread = std::thread( &MetricsExporter::ServeHttp, this );
+    TraceLog( LOG_INFO, "Serving metrics on http://127.0.0.1:%d/metrics", http_port );
+    return true;
+#else
+    TraceLog( LOG_WARNING, "--metrics-port isn't supported on this platform, use --metrics-file" );
+    return true;
+#endif
+}
+
+void MetricsExporter::Stop() {
+    if ( !file_path.empty() || http_port != 0 ) {
+        Publish();
+    }
+
+#ifndef _WIN32
+    if ( listen_fd >= 0 ) {
+        stopping = true;
+        shutdown( listen_fd, SHUT_RDWR );
+        close( listen_fd );
+        listen_fd = -1;
+    }
+#endif
+    if ( http_thread.joinable() ) {
+        http_thread.join();
+    }
+}
+
+void MetricsExporter::Update() {
+    if ( file_path.empty() && http_port == 0 ) {
+        return;
+    }
+
+    double now = GetTime();
+    if ( now - last_export < interval ) {
+        return;
+    }
+    last_export = now;
+    Publish();
+}
+
+void MetricsExporter::Publish() {
+    std::string text = metrics.Export();
+
+    if ( !file_path.empty() ) {
+        // Write next to the target and rename, so a scraper never reads half a file
+        std::string tmp_path = file_path + ".tmp";
+        FILE* file = fopen( tmp_path.c_str(), "w" );
+        if ( file != NULL ) {
+            fwrite( text.data(), 1, text.size(), file );
+            fclose( file );
+            rename( tmp_path.c_str(), file_path.c_str() );
+        } else {
+            TraceLog( LOG_WARNING, "Couldn't write metrics to %s", tmp_path.c_str() );
+        }
+    }
+
+    std::lock_guard<std::mutex> lock( snapshot_mutex );
+    snapshot = std::move( text );
+}
+
+void MetricsExporter::ServeHttp() {
+#ifndef _WIN32
+    while ( !stopping ) {
+        int client = accept( listen_fd, NULL, NULL );
+        if ( client < 0 ) {
+            if ( stopping ) {
+                break;
+            }
+            if ( errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK || errno == ECONNABORTED ) {
+                continue;
+            }
+            // Out of descriptors or memory: retrying right away would only spin
+            if ( errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM ) {
+                std::this_thread::sleep_for( std::chrono::milliseconds( METRICS_ACCEPT_BACKOFF_MS ) );
+                continue;
+            }
+            TraceLog( LOG_WARNING, "Metrics endpoint stopped, accept failed: %s", strerror( errno ) );
+            break;
+        }
+
+        // Whatever the request is, the answer is the latest snapshot
+        char request[1024];
+        recv( client, request, sizeof( request ), 0 );
+
+        std::string body;
+        {
+            std::lock_guard<std::mutex> lock( snapshot_mutex );
+            body = snapshot;
+        }
+        std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                               + std::to_string( body.size() ) + "\r\nConnection: close\r\n\r\n" + body;
+        send( client, response.data(), response.size(), 0 );
+        close( client );
+    }
+#endif
+}
+
+// Text Renderer Implementation
+
+uint64 HashBytes( const char* data, size_t len ) {
+    uint64 hash = 14695981039346656037ull;
+    for ( size_t i = 0; i < len; i++ ) {
+        hash = (hash ^ static_cast<uint8>( data[i] )) * 1099511628211ull;
+    }
+    return hash;
+}
+
+int DecodeUtf8( const char* text, int* bytes ) {
+    const unsigned char* s = reinterpret_cast<const unsigned char*>( text );
+    int codepoint, length;
+
+    if ( s[0] < 0x80 )              { *bytes = 1; return s[0]; }
+    else if ( (s[0] & 0xE0) == 0xC0 ) { codepoint = s[0] & 0x1F; length = 2; }
+    else if ( (s[0] & 0xF0) == 0xE0 ) { codepoint = s[0] & 0x0F; length = 3; }
+    else if ( (s[0] & 0xF8) == 0xF0 ) { codepoint = s[0] & 0x07; length = 4; }
+    else                              { *bytes = 1; return 0xFFFD; }
+
+    for ( int i = 1; i < length; i++ ) {
+        if ( (s[i] & 0xC0) != 0x80 ) {
+            *bytes = 1;
+            return 0xFFFD;
+        }
+        codepoint = (codepoint << 6) | (s[i] & 0x3F);
+    }
+
+    *bytes = length;
+    return codepoint;
+}
+
+// stb_truetype's SDF puts the glyph edge at 0.5, fwidth keeps it sharp at any scale
+static const char* sdf_fragment_shader =
+    "#version 330\n"
+    "in vec2 fragTexCoord;\n"
+    "in vec4 fragColor;\n"
+    "uniform sampler2D texture0;\n"
+    "out vec4 finalColor;\n"
+    "void main() {\n"
+    "    float dist = texture(texture0, fragTexCoord).r;\n"
+    "    float width = fwidth(dist);\n"
+    "    float alpha = smoothstep(0.5 - width, 0.5 + width, dist);\n"
+    "    finalColor = vec4(fragColor.rgb, fragColor.a * alpha);\n"
+    "}\n";
+
+bool TextRenderer::Load( const char* path ) {
+    font_data = LoadFileData( path, &font_data_size );
+    if ( font_data == NULL ) {
+        TraceLog( LOG_WARNING, "Couldn't load font %s", path );
+        return false;
+    }
+
+    // Single channel, the SDF only needs one. Starts with room for a few rows of glyphs
+    int height = FONT_BASE_SIZE * 8;
+    unsigned char* pixels = static_cast<unsigned char*>( calloc( FONT_ATLAS_WIDTH * height, 1 ) );
+    atlas = Image { pixels, FONT_ATLAS_WIDTH, height, 1, PIXELFORMAT_UNCOMPRESSED_GRAYSCALE };
+
+    texture = LoadTextureFromImage( atlas );
+    SetTextureFilter( texture, TEXTURE_FILTER_BILINEAR );
+    sdf_shader = LoadShaderFromMemory( NULL, sdf_fragment_shader );
+
+    font_id++;
+    loaded = true;
+    return true;
+}
+
+void TextRenderer::Unload() {
+    if ( !loaded ) {
+        return;
+    }
+    UnloadShader( sdf_shader );
+    UnloadTexture( texture );
+    UnloadImage( atlas );
+    UnloadFileData( font_data );
+    glyphs.clear();
+    quads.clear();
+    loaded = false;
+}
+
+// Shelf packing, the atlas doubles in height when it runs out of rows
+bool TextRenderer::Reserve( int w, int h, Rectangle& rec ) {
+    const int gap = 1;
+    if ( shelf_x + w + gap > atlas.width ) {
+        shelf_x = 0;
+        shelf_y += shelf_height + gap;
+        shelf_height = 0;
+    }
+
+    while ( shelf_y + h + gap > atlas.height ) {
+        int height = atlas.height * 2;
+        if ( height > FONT_ATLAS_MAX_HEIGHT ) {
+            return false;
+        }
+        unsigned char* pixels = static_cast<unsigned char*>( calloc( atlas.width * height, 1 ) );
+        memcpy( pixels, atlas.data, atlas.width * atlas.height );
+        UnloadImage( atlas );
+        atlas.data = pixels;
+        atlas.height = height;
+        atlas_grown = true;
+    }
+
+    rec = Rectangle { (float) shelf_x, (float) shelf_y, (float) w, (float) h };
+    shelf_x += w + gap;
+    shelf_height = h > shelf_height ? h : shelf_height;
+    return true;
+}
+
+const TextRenderer::Glyph& TextRenderer::GetGlyph( int codepoint ) {
+    std::lock_guard<std::mutex> lock( glyph_mutex );
+    auto it = glyphs.find( codepoint );
+    if ( it != glyphs.end() ) {
+        return it->second;
+    }
+
+    Glyph glyph = {};
+    GlyphInfo* info = LoadFontData( font_data, font_data_size, FONT_BASE_SIZE, &codepoint, 1, FONT_SDF );
+    if ( info != NULL ) {
+        glyph.offset_x = info->offsetX;
+        glyph.offset_y = info->offsetY;
+        glyph.advance = info->advanceX;
+
+        Image& image = info->image;
+        if ( image.data != NULL && image.width > 0 && image.height > 0 ) {
+            if ( Reserve( image.width, image.height, glyph.rec ) ) {
+                unsigned char* dst = static_cast<unsigned char*>( atlas.data );
+                unsigned char* src = static_cast<unsigned char*>( image.data );
+                for ( int y = 0; y < image.height; y++ ) {
+                    memcpy( dst + ((int) glyph.rec.y + y) * atlas.width + (int) glyph.rec.x, src + y * image.width, image.width );
+                }
+                atlas_dirty = true;
+            } else {
+                TraceLog( LOG_WARNING, "Glyph atlas is full, U+%04X won't render", codepoint );
+            }
+        }
+        UnloadFontData( info, 1 );
+    }
+
+    return glyphs.emplace( codepoint, glyph ).first->second;
+}
+
+float TextRenderer::Measure( const char* text, float size ) {
+    if ( !loaded ) {
+        return MeasureText( text, size );
+    }
+
+    return shaping_cache.Get( text, strlen( text ) )->advance * size / FONT_BASE_SIZE;
+}
+
+float TextRenderer::Measure( const char* text, size_t len, float size ) {
+    if ( !loaded ) {
+        return Measure( std::string( text, len ).c_str(), size );
+    }
+    return shaping_cache.Get( text, len )->advance * size / FONT_BASE_SIZE;
+}
+
+float TextRenderer::Queue( const char* text, Vector2 position, float size, Color color ) {
+    if ( !loaded ) {
+        DrawText( text, position.x, position.y, size, color );
+        return MeasureText( text, size );
+    }
+
+    return QueueRun( *shaping_cache.Get( text, strlen( text ) ), position, size, color );
+}
+
+float TextRenderer::Queue( const char* text, size_t len, Vector2 position, float size, Color color ) {
+    if ( !loaded ) {
+        return Queue( std::string( text, len ).c_str(), position, size, color );
+    }
+    return QueueRun( *shaping_cache.Get( text, len ), position, size, color );
+}
+
+float TextRenderer::QueueRun( const ShapedRun& run, Vector2 position, float size, Color color ) {
+    float scale = size / FONT_BASE_SIZE;
+    for ( const ShapedRun::ShapedGlyph& shaped : run.glyphs ) {
+        const Glyph& glyph = *shaped.glyph;
+        if ( glyph.rec.width > 0 ) {
+            quads.push_back( Quad {
+                glyph.rec,
+                Rectangle {
+                    position.x + (shaped.x + glyph.offset_x) * scale, position.y + glyph.offset_y * scale,
+                    glyph.rec.width * scale, glyph.rec.height * scale
+                },
+                color
+            } );
+        }
+    }
+    return run.advance * scale;
+}
+
+void TextRenderer::Flush() {
+    if ( !loaded || quads.empty() ) {
+        return;
+    }
+
+    // New glyphs from this frame get uploaded once, not one UpdateTexture per glyph
+    std::unique_lock<std::mutex> lock( glyph_mutex );
+    if ( atlas_grown ) {
+        UnloadTexture( texture );
+        texture = LoadTextureFromImage( atlas );
+        SetTextureFilter( texture, TEXTURE_FILTER_BILINEAR );
+        atlas_grown = atlas_dirty = false;
+    } else if ( atlas_dirty ) {
+        UpdateTexture( texture, atlas.data );
+        atlas_dirty = false;
+    }
+    lock.unlock();
+
+    // Same texture and shader for every quad, so rlgl keeps them in one draw call
+    BeginShaderMode( sdf_shader );
+    for ( const Quad& quad : quads ) {
+        DrawTexturePro( texture, quad.src, quad.dst, Vector2 { 0, 0 }, 0, quad.color );
+    }
+    EndShaderMode();
+
+    quads.clear();
+}
+
+// Text Shaping Implementation
+
+enum eBidiClass {
+    BIDI_LEFT,
+    BIDI_RIGHT,
+    BIDI_NUMBER,
+    BIDI_NEUTRAL,
+};
+
+static eBidiClass BidiClass( int cp ) {
+    if ( (cp >= 0x0590 && cp <= 0x08FF) || (cp >= 0xFB1D && cp <= 0xFDFF) || (cp >= 0xFE70 && cp <= 0xFEFF) ) {
+        return BIDI_RIGHT; // Hebrew, Arabic, Syriac, Thaana, NKo and their presentation forms
+    }
+    if ( (cp >= '0' && cp <= '9') || (cp >= 0x0660 && cp <= 0x0669) || (cp >= 0x06F0 && cp <= 0x06F9) ) {
+        return BIDI_NUMBER;
+    }
+    if ( cp < 0x80 ) {
+        return ((cp | 0x20) >= 'a' && (cp | 0x20) <= 'z') ? BIDI_LEFT : BIDI_NEUTRAL;
+    }
+    if ( (cp >= 0x2000 && cp <= 0x206F) || (cp >= 0x3000 && cp <= 0x303F) || cp == 0xA0 ) {
+        return BIDI_NEUTRAL; // spaces and general punctuation
+    }
+    if ( cp >= 0x1F000 ) {
+        return BIDI_NEUTRAL; // emoji and symbols
+    }
+    return BIDI_LEFT;
+}
+
+// Codepoints that attach to the one before them instead of starting a new cluster
+static bool IsClusterExtender( int cp ) {
+    return (cp >= 0x0300 && cp <= 0x036F)       // combining diacritics
+        || (cp >= 0x0591 && cp <= 0x05C7 && cp != 0x05BE && cp != 0x05C0 && cp != 0x05C3 && cp != 0x05C6)
+        || (cp >= 0x0610 && cp <= 0x061A) || (cp >= 0x064B && cp <= 0x065F) || cp == 0x0670 || (cp >= 0x06D6 && cp <= 0x06ED)
+        || (cp >= 0x1AB0 && cp <= 0x1AFF) || (cp >= 0x1DC0 && cp <= 0x1DFF)
+        || (cp >= 0x20D0 && cp <= 0x20FF)       // combining marks for symbols, keycap
+        || (cp >= 0xFE00 && cp <= 0xFE0F)       // variation selectors
+        || (cp >= 0xFE20 && cp <= 0xFE2F)
+        || (cp >= 0x1F3FB && cp <= 0x1F3FF)     // skin tone modifiers
+        || (cp >= 0xE0020 && cp <= 0xE007F)     // emoji tag sequences
+        || cp == 0x200D;                        // zero width joiner
+}
+
+static bool IsCombiningMark( int cp ) {
+    return IsClusterExtender( cp ) && cp != 0x200D && !(cp >= 0xFE00 && cp <= 0xFE0F)
+        && !(cp >= 0x1F3FB && cp <= 0x1F3FF) && !(cp >= 0xE0020 && cp <= 0xE007F);
+}
+
+static bool IsRegionalIndicator( int cp ) {
+    return cp >= 0x1F1E6 && cp <= 0x1F1FF;
+}
+
+void TextShaper::Shape( const char* text, size_t len, ShapedRun& run ) {
+    struct Cluster {
+        std::vector<int> codepoints; // base first
+        eBidiClass bidi;
+        int level;
+    };
+
+    std::vector<Cluster> clusters;
+    bool joining = false;  // previous codepoint was a ZWJ, the next one belongs to the same emoji
+    for ( size_t i = 0; i < len; ) {
+        int bytes;
+        int cp = DecodeUtf8( text + i, &bytes );
+        i += bytes;
+
+        bool extends = !clusters.empty() && (joining || IsClusterExtender( cp )
+            || (IsRegionalIndicator( cp ) && clusters.back().codepoints.size() == 1 && IsRegionalIndicator( clusters.back().codepoints[0] )));
+        if ( extends ) {
+            clusters.back().codepoints.push_back( cp );
+        } else {
+            clusters.push_back( Cluster { { cp }, BidiClass( cp ), 0 } );
+        }
+        joining = cp == 0x200D;
+    }
+
+    // Paragraph direction from the first strong character
+    int paragraph = 0;
+    for ( const Cluster& c : clusters ) {
+        if ( c.bidi == BIDI_LEFT || c.bidi == BIDI_RIGHT ) {
+            paragraph = c.bidi == BIDI_RIGHT;
+            break;
+        }
+    }
+
+    // First class after each cluster that isn't neutral, BIDI_NEUTRAL if there is none.
+    // One backward pass, so a long neutral run doesn't rescan its tail per cluster
+    std::vector<eBidiClass> following( clusters.size(), BIDI_NEUTRAL );
+    for ( size_t i = clusters.size(); i-- > 1; ) {
+        following[i - 1] = clusters[i].bidi != BIDI_NEUTRAL ? clusters[i].bidi : following[i];
+    }
+
+    // Resolve levels. Numbers stay left to right inside right to left text,
+    // neutrals follow their neighbours when both sides agree
+    eBidiClass last_strong = paragraph ? BIDI_RIGHT : BIDI_LEFT;
+    for ( size_t i = 0; i < clusters.size(); i++ ) {
+        Cluster& c = clusters[i];
+        eBidiClass bidi = c.bidi;
+        if ( bidi == BIDI_NEUTRAL ) {
+            eBidiClass next = following[i];
+            if ( next == BIDI_NUMBER ) {
+                next = last_strong == BIDI_RIGHT ? BIDI_RIGHT : BIDI_LEFT;
+            } else if ( next == BIDI_NEUTRAL ) {
+                next = paragraph ? BIDI_RIGHT : BIDI_LEFT;
+            }
+            bidi = last_strong == next ? next : (paragraph ? BIDI_RIGHT : BIDI_LEFT);
+        }
+
+        if ( bidi == BIDI_RIGHT ) {
+            c.level = 1;
+            last_strong = BIDI_RIGHT;
+        } else if ( bidi == BIDI_NUMBER ) {
+            c.level = (paragraph || last_strong == BIDI_RIGHT) ? 2 : 0;
+        } else {
+            c.level = paragraph ? 2 : 0;
+            last_strong = BIDI_LEFT;
+        }
+    }
+
+    // Rule L2: from the highest level down to the lowest odd one, reverse every run at or above it
+    int max_level = 0;
+    for ( const Cluster& c : clusters ) max_level = c.level > max_level ? c.level : max_level;
+    for ( int level = max_level; level >= 1; level-- ) {
+        for ( size_t i = 0; i < clusters.size(); ) {
+            if ( clusters[i].level < level ) { i++; continue; }
+            size_t end = i;
+            while ( end < clusters.size() && clusters[end].level >= level ) end++;
+            std::reverse( clusters.begin() + i, clusters.begin() + end );
+            i = end;
+        }
+    }
+
+    // Position. Emoji sequences can't be composed by an SDF font, so they draw as their
+    // first emoji; flags draw as both letters; combining marks sit on the previous glyph
+    float x = 0;
+    run.glyphs.clear();
+    for ( const Cluster& c : clusters ) {
+        const TextRenderer::Glyph& base = text_renderer.GetGlyph( c.codepoints[0] );
+        run.glyphs.push_back( { &base, x } );
+        x += base.advance;
+
+        for ( size_t i = 1; i < c.codepoints.size(); i++ ) {
+            int cp = c.codepoints[i];
+            if ( IsCombiningMark( cp ) && cp != 0x20E3 ) {
+                run.glyphs.push_back( { &text_renderer.GetGlyph( cp ), x } );
+            } else if ( IsRegionalIndicator( cp ) ) {
+                const TextRenderer::Glyph& glyph = text_renderer.GetGlyph( cp );
+                run.glyphs.push_back( { &glyph, x } );
+                x += glyph.advance;
+            }
+        }
+    }
+    run.advance = x;
+}
+
+ShapingCache::Key ShapingCache::MakeKey( const char* text, size_t len ) const {
+    return Key { HashBytes( text, len ), static_cast<uint32>( len ), text_renderer.FontId() };
+}
+
+std::shared_ptr<const ShapedRun> ShapingCache::Find( const Key& key ) {
+    std::lock_guard<std::mutex> lock( mutex );
+    auto it = index.find( key );
+    if ( it == index.end() ) {
+        return nullptr;
+    }
+    lru.splice( lru.begin(), lru, it->second );
+    return it->second->run;
+}
+
+void ShapingCache::Insert( const Key& key, std::shared_ptr<const ShapedRun> run ) {
+    std::lock_guard<std::mutex> lock( mutex );
+    if ( index.count( key ) ) {
+        return;
+    }
+
+    size_t bytes = run->Bytes() + sizeof( Entry ) + sizeof( Key ) * 2;
+    lru.push_front( Entry { key, std::move( run ), bytes } );
+    index[key] = lru.begin();
+    used += bytes;
+
+    // Runs still held by the renderer stay alive through their shared_ptr
+    while ( used > budget && lru.size() > 1 ) {
+        used -= lru.back().bytes;
+        index.erase( lru.back().key );
+        lru.pop_back();
+    }
+}
+
+std::shared_ptr<const ShapedRun> ShapingCache::Get( const char* text, size_t len ) {
+    Key key = MakeKey( text, len );
+    std::shared_ptr<const ShapedRun> run = Find( key );
+    if ( run ) {
+        return run;
+    }
+
+    auto shaped = std::make_shared<ShapedRun>();
+    TextShaper::Shape( text, len, *shaped );
+    Insert( key, shaped );
+    return shaped;
+}
+
+void ShapingCache::Prefetch( std::string text ) {
+    if ( !worker.joinable() ) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        pending.push_back( std::move( text ) );
+    }
+    pending_cv.notify_one();
+}
+
+void ShapingCache::Start() {
+    stopping = false;
+    worker = std::thread( &ShapingCache::Work, this );
+}
+
+void ShapingCache::Stop() {
+    if ( !worker.joinable() ) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        stopping = true;
+    }
+    pending_cv.notify_one();
+    worker.join();
+    Clear();
+}
+
+void ShapingCache::Clear() {
+    std::lock_guard<std::mutex> lock( mutex );
+    lru.clear();
+    index.clear();
+    pending.clear();
+    used = 0;
+}
+
+void ShapingCache::Work() {
+    while ( true ) {
+        std::string text;
+        {
+            std::unique_lock<std::mutex> lock( mutex );
+            pending_cv.wait( lock, [this] { return stopping || !pending.empty(); } );
+            if ( stopping ) {
+                return;
+            }
+            text = std::move( pending.front() );
+            pending.pop_front();
+        }
+
+        Key key = MakeKey( text.c_str(), text.size() );
+        if ( Find( key ) ) {
+            continue;
+        }
+
+        auto shaped = std::make_shared<ShapedRun>();
+        TextShaper::Shape( text.c_str(), text.size(), *shaped );
+        Insert( key, shaped );
+    }
+}
+
+// Avatar Atlas Implementation
+
+bool AvatarAtlas::Load() {
+    Image blank = GenImageColor( AVATAR_ATLAS_SIZE, AVATAR_ATLAS_SIZE, BLANK );
+    texture = LoadTextureFromImage( blank );
+    UnloadImage( blank );
+    SetTextureFilter( texture, TEXTURE_FILTER_BILINEAR );
+
+    int slots = (AVATAR_ATLAS_SIZE / AVATAR_SIZE) * (AVATAR_ATLAS_SIZE / AVATAR_SIZE);
+    for ( int i = slots - 1; i >= 0; i-- ) {
+        free_slots.push_back( i );
+    }
+
+    stopping = false;
+    worker = std::thread( &AvatarAtlas::Work, this );
+    loaded = true;
+    return true;
+}
+
+void AvatarAtlas::Unload() {
+    if ( !loaded ) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        stopping = true;
+    }
+    jobs_cv.notify_one();
+    worker.join();
+
+    UnloadTexture( texture );
+    avatars.clear();
+    free_slots.clear();
+    jobs.clear();
+    done.clear();
+    loaded = false;
+}
+
+Rectangle AvatarAtlas::SlotRect( int slot ) const {
+    int per_row = AVATAR_ATLAS_SIZE / AVATAR_SIZE;
+    return Rectangle {
+        static_cast<float>( (slot % per_row) * AVATAR_SIZE ),
+        static_cast<float>( (slot / per_row) * AVATAR_SIZE ),
+        AVATAR_SIZE, AVATAR_SIZE
+    };
+}
+
+int AvatarAtlas::TakeSlot() {
+    if ( !free_slots.empty() ) {
+        int slot = free_slots.back();
+        free_slots.pop_back();
+        return slot;
+    }
+
+    // Only runs with the atlas full, so a scan of its 256 cells is fine
+    auto oldest = avatars.end();
+    for ( auto it = avatars.begin(); it != avatars.end(); ++it ) {
+        if ( oldest == avatars.end() || it->second.used < oldest->second.used ) {
+            oldest = it;
+        }
+    }
+    if ( oldest == avatars.end() || GetTime() - oldest->second.used < AVATAR_EVICT_AFTER ) {
+        return -1;
+    }
+    // A decode still in flight for it is dropped in Update, the member is gone
+    int slot = oldest->second.slot;
+    avatars.erase( oldest );
+    return slot;
+}
+
+void AvatarAtlas::Forget( uint64 member ) {
+    auto it = avatars.find( member );
+    if ( it == avatars.end() ) {
+        return;
+    }
+    free_slots.push_back( it->second.slot );
+    avatars.erase( it );
+}
+
+void AvatarAtlas::Request( uint64 member ) {
+    auto it = avatars.find( member );
+    if ( it == avatars.end() ) {
+        int slot = TakeSlot();
+        if ( slot < 0 ) {
+            return;
+        }
+        it = avatars.emplace( member, Avatar { AVATAR_WAITING, slot } ).first;
+        it->second.used = GetTime();
+    } else if ( it->second.state != AVATAR_WAITING ) {
+        return;
+    }
+
+    int image = AVATAR_SIZE > 32 ? SteamFriends()->GetMediumFriendAvatar( member ) : SteamFriends()->GetSmallFriendAvatar( member );
+    if ( image == -1 ) {
+        return; // Steam is loading it, AvatarImageLoaded_t follows
+    }
+    if ( image == 0 ) {
+        // Not known yet, PersonaStateChange_t follows if Steam has to go fetch it
+        SteamFriends()->RequestUserInformation( member, false );
+        return;
+    }
+
+    it->second.state = AVATAR_DECODING;
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        jobs.push_back( Job { member, image, it->second.slot, {} } );
+    }
+    jobs_cv.notify_one();
+}
+
+void AvatarAtlas::OnAvatarLoaded( AvatarImageLoaded_t *pCallback ) {
+    if ( loaded && avatars.count( pCallback->m_steamID.ConvertToUint64() ) ) {
+        Request( pCallback->m_steamID.ConvertToUint64() );
+    }
+}
+
+void AvatarAtlas::OnPersonaStateChange( PersonaStateChange_t *pCallback ) {
+    if ( loaded && (pCallback->m_nChangeFlags & k_EPersonaChangeAvatar) && avatars.count( pCallback->m_ulSteamID ) ) {
+        Request( pCallback->m_ulSteamID );
+    }
+}
+
+// Worker side: copy the image out of Steam and box filter it down to the cell size
+void AvatarAtlas::Decode( Job& job ) {
+    uint32 w = 0, h = 0;
+    if ( !SteamUtils()->GetImageSize( job.image, &w, &h ) || w == 0 || h == 0 ) {
+        return;
+    }
+
+    std::vector<uint8> rgba( w * h * 4 );
+    if ( !SteamUtils()->GetImageRGBA( job.image, rgba.data(), rgba.size() ) ) {
+        return;
+    }
+
+    job.pixels.resize( AVATAR_SIZE * AVATAR_SIZE * 4 );
+    for ( int y = 0; y < AVATAR_SIZE; y++ ) {
+        uint32 y0 = y * h / AVATAR_SIZE, y1 = MIN( (y + 1) * h / AVATAR_SIZE, h );
+        y1 = y1 > y0 ? y1 : y0 + 1;
+        for ( int x = 0; x < AVATAR_SIZE; x++ ) {
+            uint32 x0 = x * w / AVATAR_SIZE, x1 = MIN( (x + 1) * w / AVATAR_SIZE, w );
+            x1 = x1 > x0 ? x1 : x0 + 1;
+
+            uint32 sum[4] = {};
+            for ( uint32 sy = y0; sy < y1; sy++ ) {
+                for ( uint32 sx = x0; sx < x1; sx++ ) {
+                    for ( int c = 0; c < 4; c++ ) sum[c] += rgba[(sy * w + sx) * 4 + c];
+                }
+            }
+            uint32 n = (y1 - y0) * (x1 - x0);
+            for ( int c = 0; c < 4; c++ ) {
+                job.pixels[(y * AVATAR_SIZE + x) * 4 + c] = static_cast<uint8>( sum[c] / n );
+            }
+        }
+    }
+}
+
+void AvatarAtlas::Work() {
+    while ( true ) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock( mutex );
+            jobs_cv.wait( lock, [this] { return stopping || !jobs.empty(); } );
+            if ( stopping ) {
+                return;
+            }
+            job = std::move( jobs.front() );
+            jobs.pop_front();
+        }
+
+        Decode( job );
+
+        std::lock_guard<std::mutex> lock( mutex );
+        done.push_back( std::move( job ) );
+    }
+}
+
+// Main thread: upload whatever the worker finished, one cell at a time
+void AvatarAtlas::Update() {
+    if ( !loaded ) {
+        return;
+    }
+
+    std::vector<Job> finished;
+    {
+        std::lock_guard<std::mutex> lock( mutex );
+        if ( done.empty() ) {
+            return;
+        }
+        finished.swap( done );
+    }
+
+    for ( Job& job : finished ) {
+        auto it = avatars.find( job.member );
+        if ( it == avatars.end() || it->second.slot != job.slot ) {
+            continue; // forgotten or evicted since, the cell may be someone else's now
+        }
+        if ( job.pixels.empty() ) {
+            it->second.state = AVATAR_WAITING; // until Steam reports a new image
+            continue;
+        }
+        UpdateTextureRec( texture, SlotRect( job.slot ), job.pixels.data() );
+        it->second.state = AVATAR_READY;
+        it->second.drawable = true;
+    }
+}
+
+bool AvatarAtlas::Ready( uint64 member ) const {
+    auto it = avatars.find( member );
+    return !loaded || (it != avatars.end() && it->second.drawable);
+}
+
+void AvatarAtlas::Restore( uint64 member, const uint8* pixels ) {
+    if ( !loaded || avatars.count( member ) ) {
+        return;
+    }
+    int slot = TakeSlot();
+    if ( slot < 0 ) {
+        return;
+    }
+    Avatar avatar = { AVATAR_READY, slot };
+    avatar.drawable = true;
+    avatar.stale = true;
+    avatar.used = GetTime();
+    UpdateTextureRec( texture, SlotRect( avatar.slot ), pixels );
+    avatars.emplace( member, avatar );
+}
+
+void AvatarAtlas::Export( const std::vector<uint64>& members, size_t max, std::vector<uint64>& ids, std::vector<uint8>& pixels ) {
+    if ( !loaded ) {
+        return;
+    }
+    Image atlas = LoadImageFromTexture( texture );
+    ImageFormat( &atlas, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8 );
+    const uint8* data = static_cast<const uint8*>( atlas.data );
+    for ( uint64 member : members ) {
+        if ( ids.size() >= max ) {
+            break;
+        }
+        auto it = avatars.find( member );
+        if ( it == avatars.end() || !it->second.drawable ) {
+            continue;
+        }
+        Rectangle cell = SlotRect( it->second.slot );
+        ids.push_back( member );
+        for ( int y = 0; y < AVATAR_SIZE; y++ ) {
+            const uint8* row = data + ((static_cast<int>( cell.y ) + y) * atlas.width + static_cast<int>( cell.x )) * 4;
+            pixels.insert( pixels.end(), row, row + AVATAR_SIZE * 4 );
+        }
+    }
+    UnloadImage( atlas );
+}
+
+void AvatarAtlas::Prefetch( uint64 member ) {
+    if ( !loaded ) {
+        return;
+    }
+    auto it = avatars.find( member );
+    if ( it == avatars.end() ) {
+        Request( member );
+    } else {
+        it->second.used = GetTime();
+    }
+}
+
+bool AvatarAtlas::Draw( uint64 member, Rectangle bounds ) {
+    if ( !loaded ) {
+        return false;
+    }
+
+    // Only the first draw asks Steam, after that the callbacks drive it
+    auto it = avatars.find( member );
+    if ( it == avatars.end() ) {
+        Request( member );
+        return false;
+    }
+    if ( it->second.stale ) {
+        it->second.stale = false;
+        it->second.state = AVATAR_WAITING;
+        Request( member );
+    }
+    it->second.used = GetTime();
+    if ( !it->second.drawable ) {
+        return false;
+    }
+
+    DrawTexturePro( texture, SlotRect( it->second.slot ), bounds, Vector2 { 0, 0 }, 0, WHITE );
+    return true;
+}
+
+// Rich Text Implementation
+
+static bool IsDelimiter( char c ) {
+    return c == '*' || c == '~' || c == '`' || c == '@' || c == ':';
+}
+
+size_t RichTextParser::FindDelimiterScalar( const char* text, size_t pos, size_t len ) {
+    while ( pos < len && !IsDelimiter( text[pos] ) ) {
+        pos++;
+    }
+    return pos;
+}
+
+// Index of the lowest set bit, `mask` isn't 0
+static int LowestSetBit( uint32 mask ) {
+#if defined(_MSC_VER) && !defined(__clang__)
+    unsigned long index;
+    _BitScanForward( &index, mask );
+    return static_cast<int>( index );
+#else
+    return __builtin_ctz( mask );
+#endif
+}
+
+size_t RichTextParser::FindDelimiter( const char* text, size_t pos, size_t len ) {
+#ifdef HAS_SSE2
+    // 16 bytes at a time: compare against every delimiter, OR the masks, take the first hit
+    const __m128i star = _mm_set1_epi8( '*' ), tilde = _mm_set1_epi8( '~' ), tick = _mm_set1_epi8( '`' );
+    const __m128i at = _mm_set1_epi8( '@' ), colon = _mm_set1_epi8( ':' );
+    for ( ; pos + 16 <= len; pos += 16 ) {
+        __m128i chunk = _mm_loadu_si128( reinterpret_cast<const __m128i*>( text + pos ) );
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128( _mm_cmpeq_epi8( chunk, star ), _mm_cmpeq_epi8( chunk, tilde ) ),
+            _mm_or_si128( _mm_or_si128( _mm_cmpeq_epi8( chunk, tick ), _mm_cmpeq_epi8( chunk, at ) ), _mm_cmpeq_epi8( chunk, colon ) ) );
+        int mask = _mm_movemask_epi8( hits );
+        if ( mask != 0 ) {
+            return pos + LowestSetBit( static_cast<uint32>( mask ) );
+        }
+    }
+#endif
+    return FindDelimiterScalar( text, pos, len );
+}
+
+static bool IsWordBreak( char c ) {
+    return c == ' ' || c == '\t' || c == '\n' || c == ',' || c == '.' || c == '!' || c == '?' || c == ')' || c == '(';
+}
+
+void RichTextParser::Parse( const std::string& input, std::vector<TextSpan>& spans ) {
+    const char* text = input.c_str();
+    size_t len = MIN( input.size(), static_cast<size_t>( UINT32_MAX ) );
+
+    spans.clear();
+    uint8 style = SPAN_PLAIN;
+    size_t start = 0;
+
+    auto emit = [&]( size_t begin, size_t end, uint8 span_style ) {
+        if ( end <= begin ) return;
+        // Neighbours with the same style merge, so plain text around a lone '*' stays one span
+        if ( !spans.empty() && spans.back().end == begin && spans.back().style == span_style ) {
+            spans.back().end = static_cast<uint32>( end );
+        } else {
+            spans.push_back( TextSpan { static_cast<uint32>( begin ), static_cast<uint32>( end ), span_style } );
+        }
+    };
+
+    // A delimiter only toggles a style when its partner shows up later in the message.
+    // One pass up front finds where each delimiter last occurs, so that's a compare
+    // per opener instead of a rescan of the rest of the text
+    size_t last_star = 0, last_double_star = 0, last_double_tilde = 0, last_tick = 0; // one past, 0 for none
+    for ( size_t p = FindDelimiter( text, 0, len ); p < len; p = FindDelimiter( text, p + 1, len ) ) {
+        bool doubled = p + 1 < len && text[p + 1] == text[p];
+        switch ( text[p] ) {
+            case '*': last_star = p + 1; last_double_star = doubled ? p + 1 : last_double_star; break;
+            case '~': last_double_tilde = doubled ? p + 1 : last_double_tilde; break;
+            case '`': last_tick = p + 1; break;
+            default: break;
+        }
+    }
+    auto closes_later = [&]( uint8 flag, size_t from ) {
+        size_t last = flag == SPAN_BOLD ? last_double_star : flag == SPAN_ITALIC ? last_star
+                    : flag == SPAN_STRIKE ? last_double_tilde : last_tick;
+        return last > from;
+    };
+
+    auto toggle = [&]( size_t p, size_t delim_len, uint8 flag ) {
+        if ( !(style & flag) && !closes_later( flag, p + delim_len ) ) {
+            return false;
+        }
+        emit( start, p, style );
+        style ^= flag;
+        start = p + delim_len;
+        return true;
+    };
+
+    size_t p = FindDelimiter( text, 0, len );
+    while ( p < len ) {
+        char c = text[p];
+        size_t next = p + 1;
+
+        if ( style & SPAN_CODE ) {
+            // Nothing but the closing backtick means anything inside code
+            if ( c == '`' ) toggle( p, 1, SPAN_CODE );
+        } else if ( c == '*' && p + 1 < len && text[p + 1] == '*' ) {
+            toggle( p, 2, SPAN_BOLD );
+            next = p + 2;
+        } else if ( c == '*' ) {
+            toggle( p, 1, SPAN_ITALIC );
+        } else if ( c == '~' && p + 1 < len && text[p + 1] == '~' ) {
+            toggle( p, 2, SPAN_STRIKE );
+            next = p + 2;
+        } else if ( c == '`' ) {
+            toggle( p, 1, SPAN_CODE );
+        } else if ( c == '@' && (p == 0 || IsWordBreak( text[p - 1] )) ) {
+            size_t end = p + 1;
+            while ( end < len && !IsWordBreak( text[end] ) ) end++;
+            if ( end > p + 1 ) {
+                emit( start, p, style );
+                emit( p, end, style | SPAN_MENTION );
+                start = next = end;
+            }
+        } else if ( c == ':' && p + 2 < len && text[p + 1] == '/' && text[p + 2] == '/' ) {
+            size_t scheme = p >= 5 && memcmp( text + p - 5, "https", 5 ) == 0 ? p - 5
+                          : p >= 4 && memcmp( text + p - 4, "http", 4 ) == 0 ? p - 4 : p;
+            if ( scheme < p && scheme >= start && (scheme == 0 || IsWordBreak( text[scheme - 1] )) ) {
+                size_t end = p + 3;
+                while ( end < len && text[end] != ' ' && text[end] != '\t' && text[end] != '\n' ) end++;
+                emit( start, scheme, style );
+                emit( scheme, end, style | SPAN_LINK );
+                start = next = end;
+            }
+        }
+
+        p = FindDelimiter( text, next, len );
+    }
+    emit( start, len, style );
+}
+
+int RichTextParser::Benchmark() {
+    static const char* samples[] = {
+        "[alice]: hey **everyone**, the build is up at https://example.com/builds/1234 check it",
+        "[bob]: @alice thanks! `make -j8` took *forever* on my machine though",
+        "[carol]: ~~old plan~~ new plan: meet at 14:00 in the usual channel, ping @dave",
+        "[dave]: plain message with nothing special in it, just a long sentence about the weather today and tomorrow",
+        "[SERVER]: eve has Joined the lobby",
+    };
+
+    std::vector<std::string> messages;
+    size_t bytes = 0;
+    for ( int i = 0; i < BENCH_PARSE_MESSAGES; i++ ) {
+        messages.push_back( samples[i % (sizeof( samples ) / sizeof( samples[0] ))] );
+        bytes += messages.back().size();
+    }
+
+    std::vector<TextSpan> spans;
+    size_t total_spans = 0;
+    uint64 start = Tracer::Now();
+    for ( int round = 0; round < BENCH_PARSE_ROUNDS; round++ ) {
+        for ( const std::string& msg : messages ) {
+            RichTextParser::Parse( msg, spans );
+            total_spans += spans.size();
+        }
+    }
+    double parse_seconds = (Tracer::Now() - start) / 1e6;
 
-    char chatMsg[MAX_CHATMSG_SIZE];
-    uint64 id;
+    // Delimiter scanning on its own, where the SIMD path matters
+    auto scan = [&]( size_t (*find)( const char*, size_t, size_t ) ) {
+        size_t hits = 0;
+        uint64 t = Tracer::Now();
+        for ( int round = 0; round < BENCH_PARSE_ROUNDS; round++ ) {
+            for ( const std::string& msg : messages ) {
+                for ( size_t p = find( msg.c_str(), 0, msg.size() ); p < msg.size(); p = find( msg.c_str(), p + 1, msg.size() ) ) hits++;
+            }
+        }
+        return std::make_pair( (Tracer::Now() - t) / 1e6, hits );
+    };
+    auto simd = scan( &RichTextParser::FindDelimiter );
+    auto scalar = scan( &RichTextParser::FindDelimiterScalar );
 
-    void CreateLobby();
-    void JoinLobby(uint64 SteamID);
-    void LeaveLobby();
-    void SendMessage(std::string sender, std::string msg);
+    double total_mb = bytes * (double) BENCH_PARSE_ROUNDS / (1024 * 1024);
+    size_t total_msgs = messages.size() * BENCH_PARSE_ROUNDS;
+    printf( "parse:        %8.1f MB/s  %10.0f msgs/s  (%.2f spans / msg)\n",
+            total_mb / parse_seconds, total_msgs / parse_seconds, (double) total_spans / total_msgs );
+#ifdef HAS_SSE2
+    printf( "scan (sse2):  %8.1f MB/s  (%zu delimiters)\n", total_mb / simd.first, simd.second );
+#else
+    printf( "scan:         %8.1f MB/s  (%zu delimiters, no SIMD on this target)\n", total_mb / simd.first, simd.second );
+#endif
+    printf( "scan (scalar):%8.1f MB/s  (%zu delimiters)\n", total_mb / scalar.first, scalar.second );
+    return EXIT_SUCCESS;
+}
 
-    void reFillMembersVector();
+// History Implementation
 
-private:
-    // call Values
-    // where u handle the lobby creation. Till this is called, we show a Loading Screen
-    void OnLobbyCreate( LobbyCreated_t *pCallback, bool bIOFailure );
-    CCallResult< LobbyManager, LobbyCreated_t > m_LobbyCreateCallResult;
+void TimeIndex::Append( const std::vector<ChatMessage>& messages ) {
+    size_t i = messages.size() - 1;
+    if ( i % TIME_INDEX_STRIDE == 0 ) {
+        samples.push_back( messages[i].timestamp );
+    }
+}
 
-    void OnLobbyJoin( LobbyEnter_t *pCallback, bool bIOFailure );
-    CCallResult< LobbyManager, LobbyEnter_t > m_LobbyJoinCallResult;
+size_t TimeIndex::LowerBound( const std::vector<ChatMessage>& messages, int64 timestamp ) const {
+    // Last block that starts before the timestamp, the answer is in it or right at the next one
+    auto block = std::lower_bound( samples.begin(), samples.end(), timestamp );
+    if ( block == samples.begin() ) {
+        return 0;
+    }
+    size_t begin = (block - samples.begin() - 1) * TIME_INDEX_STRIDE;
+    size_t end = MIN( begin + TIME_INDEX_STRIDE, messages.size() );
 
-    // Call Backs
-    STEAM_CALLBACK( LobbyManager, OnLobbyDataUpdate, LobbyChatUpdate_t );
-    STEAM_CALLBACK( LobbyManager, OnLobbyMessageRecieved, LobbyChatMsg_t );
-};
+    auto it = std::lower_bound( messages.begin() + begin, messages.begin() + end, timestamp,
+        []( const ChatMessage& message, int64 t ) { return message.timestamp < t; } );
+    return it - messages.begin();
+}
 
-static LobbyManager lobby_manager;
+void ReadWatermarks::Load( const char* path ) {
+    FILE* file = fopen( path, "r" );
+    if ( file == NULL ) {
+        return;
+    }
+    unsigned long long lobby;
+    long long timestamp;
+    while ( fscanf( file, "%llu %lld", &lobby, &timestamp ) == 2 ) {
+        watermarks[lobby] = timestamp;
+    }
+    fclose( file );
+}
 
-int main() {
-    // This Starts the game in Steam
-    if ( SteamAPI_RestartAppIfNecessary( APP_ID ) ) {
-        return 1;
+void ReadWatermarks::Save( const char* path ) {
+    FILE* file = fopen( path, "w" );
+    if ( file == NULL ) {
+        TraceLog( LOG_WARNING, "Couldn't save read markers to %s", path );
+        return;
+    }
+    for ( auto& [lobby, timestamp] : watermarks ) {
+        fprintf( file, "%llu %lld\n", (unsigned long long) lobby, (long long) timestamp );
     }
+    fclose( file );
+    dirty = false;
+    last_save = GetTime();
+}
 
-    InitWindow(800, 600, "Steam Test");
-    SetWindowState(FLAG_WINDOW_RESIZABLE);
+void ReadWatermarks::SaveIfDirty( const char* path ) {
+    if ( dirty && GetTime() - last_save >= WATERMARKS_SAVE_INTERVAL ) {
+        Save( path );
+    }
+}
 
-    SetExitKey(0);
+int64 ReadWatermarks::Get( uint64 lobby ) const {
+    auto it = watermarks.find( lobby );
+    return it == watermarks.end() ? -1 : it->second;
+}
 
-    if ( !SteamAPI_Init() ) {
-        std::cout << "An instance of Steam needs to be running" << std::endl;
-        return EXIT_FAILURE;
+void ReadWatermarks::Advance( uint64 lobby, int64 timestamp ) {
+    int64& watermark = watermarks.try_emplace( lobby, -1 ).first->second;
+    if ( timestamp > watermark ) {
+        watermark = timestamp;
+        dirty = true;
     }
+}
 
-    screen_state = eScreenState::OUTSIDE_LOBBY;
-    SetTargetFPS(100);
+// Session Snapshot Implementation
 
-    while ( !WindowShouldClose() && !program.should_quit ) {
-        BeginDrawing();
-        DrawFPS(0, 0);
-        SteamAPI_RunCallbacks();
-        ClearBackground(RAYWHITE);
-        // LOG( screen_state );
-        switch ( screen_state ) {
-            case eScreenState::LOADING:
-                Screen::renderLoading();
-                break;
-            case eScreenState::OUTSIDE_LOBBY:
-                Screen::renderOutsideLobby();
-                break;
-            case eScreenState::LOBBY_CREATION:
-                Screen::renderLobbyCreation();
-                break;
-            case eScreenState::LOBBY_JOIN:
-                Screen::renderLobbyJoin();
-                break;
-            case eScreenState::LOBBY:
-                Screen::renderLobby();
-                break;
-        }
+bool SessionSnapshot::Open( const char* path ) {
+    Close();
+#ifdef _WIN32
+    FILE* file = fopen( path, "rb" );
+    if ( file == NULL ) {
+        return false;
+    }
+    fseek( file, 0, SEEK_END );
+    buffer.resize( ftell( file ) );
+    fseek( file, 0, SEEK_SET );
+    bool read = fread( buffer.data(), 1, buffer.size(), file ) == buffer.size();
+    fclose( file );
+    if ( !read ) {
+        return false;
+    }
+    data = buffer.data();
+    size = buffer.size();
+#else
+    int fd = open( path, O_RDONLY );
+    if ( fd < 0 ) {
+        return false;
+    }
+    struct stat info;
+    if ( fstat( fd, &info ) != 0 || info.st_size < (off_t) sizeof( Header ) ) {
+        close( fd );
+        return false;
+    }
+    void* mapped = mmap( NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if ( mapped == MAP_FAILED ) {
+        return false;
+    }
+    data = static_cast<const uint8*>( mapped );
+    size = info.st_size;
+#endif
 
-        EndDrawing();
+    const Header* h = size >= sizeof( Header ) ? &header() : NULL;
+    bool valid = h != NULL && memcmp( h->magic, SNAPSHOT_MAGIC, 4 ) == 0 && h->version == SNAPSHOT_VERSION
+        && (h->message_count == 0 || Section<Message>( h->messages_offset, h->message_count ))
+        && (h->run_count == 0 || Section<Run>( h->runs_offset, h->run_count ))
+        && (h->member_count == 0 || Section<Member>( h->members_offset, h->member_count ))
+        && (h->avatar_count == 0 || Section<Avatar>( h->avatars_offset, h->avatar_count ))
+        && (uint64) h->strings_offset + h->strings_size <= size;
+    if ( !valid ) {
+        TraceLog( LOG_WARNING, "Ignoring %s, it's damaged or from another version", path );
+        Close();
     }
-    lobby_manager.LeaveLobby();
-    CloseWindow();
-    SteamAPI_Shutdown();
+    return valid;
 }
 
-void Screen::renderLoading() {
-    DrawText(program.loading_screen_text.c_str(), 100, 100, 32, BLACK);
+void SessionSnapshot::Close() {
+#ifdef _WIN32
+    buffer.clear();
+#else
+    if ( data != NULL ) {
+        munmap( const_cast<uint8*>( data ), size );
+    }
+#endif
+    data = NULL;
+    size = 0;
 }
 
-void Screen::renderOutsideLobby() {
-    if ( GuiButton( Rectangle {0, 0, 300, 50}, "Create Lobby" ) ) {
-        screen_state = eScreenState::LOBBY_CREATION;
+template <typename T>
+const T* SessionSnapshot::Section( uint32 offset, uint32 count ) const {
+    if ( offset % alignof( T ) != 0 || (uint64) offset + (uint64) count * sizeof( T ) > size ) {
+        return NULL;
     }
-    if ( GuiButton( Rectangle {0, 100, 300, 50}, "Join Lobby" ) ) {
-        screen_state = eScreenState::LOBBY_JOIN;
+    return reinterpret_cast<const T*>( data + offset );
+}
+
+std::string SessionSnapshot::String( Text text ) const {
+    const Header& h = header();
+    if ( (uint64) text.offset + text.size > h.strings_size ) {
+        return std::string();
     }
-    if ( GuiButton( Rectangle {0, 200, 300, 50}, "Quit" ) ) {
-        program.should_quit = true;
+    return std::string( reinterpret_cast<const char*>( data ) + h.strings_offset + text.offset, text.size );
+}
+
+void SessionSnapshot::WindowSize( int* width, int* height ) const {
+    if ( data != NULL && header().window_width > 0 && header().window_height > 0 ) {
+        *width = header().window_width;
+        *height = header().window_height;
     }
 }
 
-void Screen::renderLobbyCreation() {
-    float window_width = GetScreenWidth();
-    float window_height = GetScreenHeight();
+uint64 SessionSnapshot::Restore() {
+    if ( data == NULL ) {
+        return 0;
+    }
+    TRACE_SCOPE( "RestoreSnapshot", "startup" );
+    const Header& h = header();
 
-    float w = 0.3 * window_width;
-    float h = MIN( 0.1 * window_height, 30 );
+    member_list.SetSort( h.member_sort == MemberList::SORT_STATUS ? MemberList::SORT_STATUS : MemberList::SORT_NAME );
+    std::string filter = String( h.member_filter );
+    strncpy( member_list.filter_text, filter.c_str(), sizeof( member_list.filter_text ) - 1 );
+    member_list.SetFilter( member_list.filter_text );
+    if ( h.lobby == 0 ) {
+        return 0;
+    }
 
-    Rectangle textbox_bounds = { 
-        static_cast<float>(0.5 * (window_width - w)),
-        static_cast<float>(0.5 * (window_height - h)), 
-        w, h
+    const Message* messages = Section<Message>( h.messages_offset, h.message_count );
+    const Run* runs = Section<Run>( h.runs_offset, h.run_count );
+    uint32 next_run = 0;
+    auto restore_runs = [&]( uint32 before ) {
+        for ( ; next_run < h.run_count && runs[next_run].before <= before; next_run++ ) {
+            const Run& saved = runs[next_run];
+            MembershipRun run;
+            run.first_time = saved.first_time;
+            run.last_time = saved.last_time;
+            run.joined = saved.joined;
+            run.left = saved.left;
+            std::string names = String( saved.names );
+            for ( size_t begin = 0; begin < names.size(); ) {
+                size_t end = MIN( names.find( '\n', begin ), names.size() );
+                run.names.push_back( names.substr( begin, end - begin ) );
+                begin = end + 1;
+            }
+            lobby_manager.AppendRun( std::move( run ) );
+        }
     };
+    for ( uint32 i = 0; i < h.message_count; i++ ) {
+        restore_runs( i );
+        std::string text = String( messages[i].text );
+        lobby_manager.AppendMessage( text.data(), text.size(), messages[i].timestamp );
+    }
+    restore_runs( UINT32_MAX );
+    lobby_manager.history_lobby = h.lobby;
+    lobby_manager.lobby_leader = String( h.lobby_leader );
+    std::string name = String( h.lobby_name );
+    strncpy( lobby_manager.lobby_name, name.c_str(), sizeof( lobby_manager.lobby_name ) - 1 );
 
-    Rectangle button_bounds = {
-        static_cast<float>(0.5 * (window_width - w)),
-        static_cast<float>(0.5 * (window_height - h)) + 100, 
-        w, h
-    };
+    const Member* members = Section<Member>( h.members_offset, h.member_count );
+    for ( uint32 i = 0; i < h.member_count; i++ ) {
+        member_list.Restore( members[i].id, String( members[i].name ), members[i].status_rank );
+    }
+    const Avatar* cells = Section<Avatar>( h.avatars_offset, h.avatar_count );
+    for ( uint32 i = 0; i < h.avatar_count; i++ ) {
+        avatars.Restore( cells[i].id, cells[i].pixels );
+    }
 
-    if ( GuiTextBox( textbox_bounds, lobby_manager.lobby_name, 100, true ) || GuiButton( button_bounds, "Create Lobby" )) {
-        if ( strlen( lobby_manager.lobby_name ) > 6 ) {
-            screen_state = eScreenState::LOADING;
-            program.loading_screen_text = "Creating Lobby";
+    chat_view.scroll = h.scroll;
+    chat_view.velocity = 0;
+    chat_view.target = -1;
+    chat_view.stick_to_bottom = h.stick_to_bottom;
+    chat_view.unread_after = read_watermarks.Get( h.lobby );
 
-            lobby_manager.CreateLobby();
-        }
-    }
+    TraceLog( LOG_INFO, "Restored lobby %llu from the last session: %u messages, %u members, %u avatars",
+              (unsigned long long) h.lobby, h.message_count, h.member_count, h.avatar_count );
+    return h.lobby;
 }
 
-void Screen::renderLobbyJoin() {
-    float window_width = GetScreenWidth();
-    float window_height = GetScreenHeight();
+bool SessionSnapshot::Save( const char* path ) {
+    std::vector<uint8> out( sizeof( Header ) );
+    std::string strings;
+    auto text = [&strings]( const std::string& value ) {
+        Text text = { static_cast<uint32>( strings.size() ), static_cast<uint32>( value.size() ) };
+        strings += value;
+        return text;
+    };
+    auto append = [&out]( const void* value, size_t bytes ) {
+        out.insert( out.end(), static_cast<const uint8*>( value ), static_cast<const uint8*>( value ) + bytes );
+    };
+    auto align = [&out]() {
+        out.resize( (out.size() + 7) & ~(size_t) 7 );
+        return static_cast<uint32>( out.size() );
+    };
 
-    float w = 0.3 * window_width;
-    float h = MIN( 0.1 * window_height, 30 );
+    Header h = {};
+    memcpy( h.magic, SNAPSHOT_MAGIC, 4 );
+    h.version = SNAPSHOT_VERSION;
+    h.lobby = lobby_manager.id;
+    h.saved_at = std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::system_clock::now().time_since_epoch() ).count();
+    h.window_width = GetScreenWidth();
+    h.window_height = GetScreenHeight();
+    h.scroll = chat_view.scroll;
+    h.stick_to_bottom = chat_view.stick_to_bottom;
+    h.member_sort = member_list.Sort();
+    h.member_filter = text( member_list.filter_text );
 
-    Rectangle textbox_bounds = { 
-        static_cast<float>(0.5 * (window_width - w)),
-        static_cast<float>(0.5 * (window_height - h)), 
-        w, h
-    };
+    if ( lobby_manager.id != 0 ) {
+        h.lobby_name = text( lobby_metadata.Get( lobby_manager.id ).name );
+        h.lobby_leader = text( lobby_manager.lobby_leader );
 
-    Rectangle button_bounds = {
-        static_cast<float>(0.5 * (window_width - w)),
-        static_cast<float>(0.5 * (window_height - h)) + 100, 
-        w, h
-    };
+        const std::vector<ChatMessage>& messages = lobby_manager.messages;
+        size_t first = messages.size() > SNAPSHOT_MESSAGES ? messages.size() - SNAPSHOT_MESSAGES : 0;
+        h.messages_offset = align();
+        for ( size_t i = first; i < messages.size(); i++ ) {
+            Message message = { messages[i].timestamp, text( messages[i].text ) };
+            append( &message, sizeof( message ) );
+            h.message_count++;
+        }
 
-    if ( GuiTextBox( textbox_bounds, lobby_manager.lobby_id_text_box, 100, true ) || GuiButton( button_bounds, "Join Lobby" )) {
-        if ( strlen( lobby_manager.lobby_id_text_box) > 0 ) {
-            screen_state = eScreenState::LOADING;
-            program.loading_screen_text = "Joining Lobby";
+        // Runs from the row of the first saved message on, placed by the messages below them
+        h.runs_offset = align();
+        const std::vector<MessageRow>& rows = lobby_manager.rows;
+        uint32 before = 0;
+        for ( size_t r = first < messages.size() ? messages[first].row : 0; r < rows.size(); r++ ) {
+            if ( rows[r].kind != ROW_MEMBERSHIP ) {
+                before++;
+                continue;
+            }
+            const MembershipRun& run = lobby_manager.membership_runs[rows[r].index];
+            std::string names;
+            for ( const std::string& name : run.names ) {
+                names += (names.empty() ? "" : "\n") + name;
+            }
+            Run saved = { run.first_time, run.last_time, run.joined, run.left, before, 0, text( names ) };
+            append( &saved, sizeof( saved ) );
+            h.run_count++;
+        }
 
-            lobby_manager.JoinLobby(std::stoull(lobby_manager.lobby_id_text_box));
+        h.members_offset = align();
+        for ( uint64 id : lobby_manager.members ) {
+            Member member = { id, text( member_list.Name( id ) ), member_list.Away( id ) ? 1 : 0, 0 };
+            append( &member, sizeof( member ) );
+            h.member_count++;
         }
-    }
-}
 
-void Screen::renderLobby() {
-    Rectangle members_panel = {
-        0, 0, 
-        static_cast<float>( 0.2 * GetScreenWidth() ), 
-        static_cast<float>( GetScreenHeight() )
-    };
+        // The cells of the first rows of the members panel
+        std::vector<uint64> ids;
+        std::vector<uint8> pixels;
+        avatars.Export( member_list.Visible(), PREFETCH_AVATARS, ids, pixels );
+        h.avatars_offset = align();
+        for ( size_t i = 0; i < ids.size(); i++ ) {
+            append( &ids[i], sizeof( uint64 ) );
+            append( &pixels[i * AVATAR_SIZE * AVATAR_SIZE * 4], AVATAR_SIZE * AVATAR_SIZE * 4 );
+            h.avatar_count++;
+        }
+    }
 
-    Rectangle chat_panel = {
-        members_panel.width, 0,
-        static_cast<float>( GetScreenWidth() - members_panel.width ),
-        members_panel.height
-    };
+    h.strings_offset = align();
+    h.strings_size = static_cast<uint32>( strings.size() );
+    append( strings.data(), strings.size() );
+    memcpy( out.data(), &h, sizeof( h ) );
 
-    GuiPanel( members_panel, TextFormat( "Online: %d", lobby_manager.members.size() ) );
-    
-    float font_height = 20;
-    Vector2 padding = {10, 50};
-    for (int i = 0; i < lobby_manager.members.size(); i++) {
-        float y_offset = i * font_height + 10;
-        const char* username = SteamFriends()->GetFriendPersonaName( lobby_manager.members[i] );
-        DrawText(username, padding.x, padding.y + y_offset, font_height / 10, BLACK);
+    std::string temporary = std::string( path ) + ".tmp";
+    FILE* file = fopen( temporary.c_str(), "wb" );
+    if ( file == NULL ) {
+        TraceLog( LOG_WARNING, "Couldn't save the session to %s", path );
+        return false;
+    }
+    bool written = fwrite( out.data(), 1, out.size(), file ) == out.size();
+    written = fclose( file ) == 0 && written;
+#ifdef _WIN32
+    remove( path ); // rename won't replace on Windows
+#endif
+    if ( !written || rename( temporary.c_str(), path ) != 0 ) {
+        TraceLog( LOG_WARNING, "Couldn't save the session to %s", path );
+        remove( temporary.c_str() );
+        return false;
     }
+    return true;
+}
+
+// Chat Input Implementation
 
-    GuiPanel( chat_panel, TextFormat( "%s Lobby: Owned by %s", lobby_manager.lobby_name, lobby_manager.lobby_leader.c_str()) );
+void GapBuffer::MoveGap( size_t pos ) {
+    if ( pos < gap_start ) {
+        size_t count = gap_start - pos;
+        memmove( data.data() + gap_end - count, data.data() + pos, count );
+        gap_start -= count;
+        gap_end -= count;
+    } else if ( pos > gap_start ) {
+        size_t count = pos - gap_start;
+        memmove( data.data() + gap_start, data.data() + gap_end, count );
+        gap_start += count;
+        gap_end += count;
+    }
+}
 
-    padding = {chat_panel.x + 20, chat_panel.y + 70};
-    for (int i = 0; i < lobby_manager.messages.size(); i++) {
-        float y_offset = i * font_height + 20;
-        DrawText(lobby_manager.messages[i].c_str(), padding.x, padding.y + y_offset, font_height / 2, BLACK);
+void GapBuffer::Insert( size_t pos, const char* text, size_t len ) {
+    if ( gap_end - gap_start < len ) {
+        // Grow the gap, the text after it moves to the end of the new storage
+        size_t tail = data.size() - gap_end;
+        size_t capacity = MIN( (data.size() + len) * 2, data.size() + len + 1024 * 1024 );
+        capacity = capacity > 64 ? capacity : 64;
+        data.resize( capacity );
+        memmove( data.data() + capacity - tail, data.data() + gap_end, tail );
+        gap_end = capacity - tail;
     }
+    MoveGap( pos );
+    memcpy( data.data() + gap_start, text, len );
+    gap_start += len;
+}
 
-    float chat_box_height = 50;
-    Rectangle chat_box = {
-        chat_panel.x,
-        static_cast<float>(GetScreenHeight() - chat_box_height),
-        chat_panel.width,
-        chat_box_height
-    };
+void GapBuffer::Erase( size_t pos, size_t len ) {
+    MoveGap( pos );
+    gap_end += len;
+}
 
-    if ( GuiTextBox(chat_box, lobby_manager.chatMsg, MAX_CHATMSG_SIZE, true) ) {
-        lobby_manager.SendMessage(SteamFriends()->GetPersonaName(), lobby_manager.chatMsg);
-        // Clears the text
+std::string GapBuffer::Substr( size_t pos, size_t len ) const {
+    std::string out;
+    out.reserve( len );
+    size_t end = pos + len;
+    if ( pos < gap_start ) {
+        out.append( data.data() + pos, MIN( end, gap_start ) - pos );
+    }
+    if ( end > gap_start ) {
+        size_t from = pos > gap_start ? pos : gap_start;
+        out.append( data.data() + from + (gap_end - gap_start), end - from );
     }
+    return out;
 }
 
-// Lobby Manager Implementation
+void ChatInput::Clear() {
+    buffer.Clear();
+    line_lengths.assign( 1, 0 );
+    known = Location { 0, 0, 0 };
+    cursor = anchor = 0;
+    scroll_line = scroll_column = 0;
+    undo_stack.clear();
+    redo_stack.clear();
+}
 
-void LobbyManager::SendMessage( std::string sender, std::string msg ) {
-    const char* full_msg = TextFormat( "[%s]: %s", sender.c_str(), msg.c_str() );
-    TraceLog( LOG_INFO, "%s : %d", full_msg, msg.size() );
+float ChatInput::Height( float font_size ) const {
+    size_t lines = MIN( line_lengths.size(), static_cast<size_t>( CHAT_INPUT_MAX_VISIBLE_LINES ) );
+    float height = lines * (font_size + 4) + 20;
+    return height > 50 ? height : 50;
+}
 
-    SteamMatchmaking()->SendLobbyChatMsg( lobby_manager.id, full_msg, strlen(full_msg) );
-    std::memset( lobby_manager.chatMsg, 0, strlen(lobby_manager.chatMsg) + 1 );
+// Walks line by line from the last located position
+ChatInput::Location ChatInput::Locate( size_t pos ) {
+    Location at = known;
+    while ( pos < at.pos - at.column ) {
+        at.line--;
+        at.pos -= at.column + line_lengths[at.line] + 1;
+        at.column = 0;
+    }
+    at.pos -= at.column;
+    at.column = 0;
+    while ( pos > at.pos + line_lengths[at.line] ) {
+        at.pos += line_lengths[at.line] + 1;
+        at.line++;
+    }
+    at.column = pos - at.pos;
+    at.pos = pos;
+    known = at;
+    return at;
 }
 
-void LobbyManager::CreateLobby() {
-    SteamAPICall_t hSteamAPICall = SteamMatchmaking()->CreateLobby( k_ELobbyTypePublic, 100 );
-    m_LobbyCreateCallResult.Set( hSteamAPICall, this, &LobbyManager::OnLobbyCreate );
+size_t ChatInput::LineStart( size_t line ) {
+    Location at = known;
+    size_t start = at.pos - at.column;
+    for ( ; at.line > line; at.line-- ) start -= line_lengths[at.line - 1] + 1;
+    for ( ; at.line < line; at.line++ ) start += line_lengths[at.line] + 1;
+    return start;
 }
 
-void LobbyManager::OnLobbyCreate( LobbyCreated_t *pCallback, bool bIOFailure ) {
+void ChatInput::ApplyInsert( size_t pos, const char* text, size_t len ) {
+    Location at = Locate( pos );
+    buffer.Insert( pos, text, len );
 
-    if ( bIOFailure ) {
-        LOG( "[INTERNAL ERROR] Couldn't Create Server" );
+    const char* newline = static_cast<const char*>( memchr( text, '\n', len ) );
+    if ( newline == NULL ) {
+        line_lengths[at.line] += len;
+        return;
     }
 
-    bool failed = true;
-    switch ( pCallback->m_eResult ) {
-        case k_EResultFail:
-            TraceLog( LOG_ERROR, "The server responded, but with an unknown internal error." );
-            break;
-        case k_EResultTimeout:
-            TraceLog( LOG_ERROR, "The message was sent to the Steam servers, but it didn't respond." );
-            break;
-        case k_EResultLimitExceeded:
-            TraceLog( LOG_ERROR, "Your game client has created too many lobbies and is being rate limited." );
-            break;
-        case k_EResultAccessDenied:
-            TraceLog( LOG_ERROR, "Your game isn't set to allow lobbies, or your client does haven't rights to play the game" );
-            break;
-        case k_EResultNoConnection:
-            TraceLog( LOG_ERROR, "Your Steam client doesn't have a connection to the back-end." );
-            break;
-        case k_EResultOK:
-            TraceLog(LOG_INFO, "Created Lobby Succesfully. Lobby ID: %lld", pCallback->m_ulSteamIDLobby);
-            failed = false;
-            break;
-        default:
-            TraceLog(LOG_ERROR, "Shouldn't be reachable");
-            return;
+    // Split the line at the insert point and add one entry per inserted line
+    uint32 tail = line_lengths[at.line] - at.column;
+    std::vector<uint32> lines;
+    line_lengths[at.line] = at.column + (newline - text);
+    const char* start = newline + 1;
+    const char* end = text + len;
+    while ( (newline = static_cast<const char*>( memchr( start, '\n', end - start ) )) != NULL ) {
+        lines.push_back( newline - start );
+        start = newline + 1;
     }
+    lines.push_back( (end - start) + tail );
+    line_lengths.insert( line_lengths.begin() + at.line + 1, lines.begin(), lines.end() );
+}
 
-    if ( failed ) {
-        screen_state = eScreenState::OUTSIDE_LOBBY;
-        return;
+void ChatInput::ApplyErase( size_t pos, size_t len ) {
+    Location at = Locate( pos );
+    size_t joined = 0;
+    for ( size_t i = 0; i < len; i++ ) {
+        joined += buffer.At( pos + i ) == '\n';
     }
 
-    lobby_manager.id = pCallback->m_ulSteamIDLobby;
-    if ( !SteamMatchmaking()->SetLobbyData( (CSteamID) lobby_manager.id, "lobby_name", std::string( lobby_manager.lobby_name ).c_str() ) ) {
-        TraceLog(LOG_ERROR, "Invalid Lobby ID");
+    // The first and last touched lines merge into one. last_column is where
+    // the erased range ends on its last line
+    size_t last = at.line + joined;
+    size_t last_column = at.column + len;
+    if ( joined ) {
+        size_t i = len;
+        while ( i > 0 && buffer.At( pos + i - 1 ) != '\n' ) i--;
+        last_column = len - i;
     }
+    line_lengths[at.line] = at.column + (line_lengths[last] - last_column);
+    line_lengths.erase( line_lengths.begin() + at.line + 1, line_lengths.begin() + last + 1 );
+    buffer.Erase( pos, len );
+}
 
-    // First member in the lobby
-    lobby_manager.members.push_back( SteamUser()->GetSteamID().ConvertToUint64() );
-    lobby_manager.lobby_leader = SteamFriends()->GetPersonaName();
+void ChatInput::Replace( size_t begin, size_t end, const char* text, size_t len, bool coalesce ) {
+    Edit edit { begin, buffer.Substr( begin, end - begin ), std::string( text, len ), cursor, begin + len, GetTime() };
+    last_edit = edit.time;
 
-    if ( !SteamMatchmaking()->SetLobbyData( lobby_manager.id, "lobby_leader", lobby_manager.lobby_leader.c_str() ) ) {
-        TraceLog(LOG_ERROR, "Invalid Lobby ID");
+    if ( end > begin ) ApplyErase( begin, end - begin );
+    if ( len > 0 ) ApplyInsert( begin, text, len );
+    MoveCursor( begin + len, false );
+
+    // Typing runs merge into one undo step, as long as the user keeps going
+    redo_stack.clear();
+    Edit* last = undo_stack.empty() ? NULL : &undo_stack.back();
+    if ( coalesce && last != NULL && edit.removed.empty() && last->removed.empty()
+         && last->pos + last->inserted.size() == begin && edit.time - last->time < 1.0
+         && memchr( text, '\n', len ) == NULL && last->inserted.size() < 256 ) {
+        last->inserted += edit.inserted;
+        last->cursor_after = edit.cursor_after;
+        last->time = edit.time;
+        return;
     }
 
-    screen_state = eScreenState::LOBBY;
+    undo_stack.push_back( std::move( edit ) );
+    if ( undo_stack.size() > CHAT_INPUT_UNDO_LIMIT ) {
+        undo_stack.erase( undo_stack.begin() );
+    }
+}
 
-    SetClipboardText( TextFormat( "%lld", lobby_manager.id ) );
+void ChatInput::Undo() {
+    if ( undo_stack.empty() ) return;
+    Edit edit = std::move( undo_stack.back() );
+    undo_stack.pop_back();
+
+    if ( !edit.inserted.empty() ) ApplyErase( edit.pos, edit.inserted.size() );
+    if ( !edit.removed.empty() ) ApplyInsert( edit.pos, edit.removed.data(), edit.removed.size() );
+    MoveCursor( edit.cursor_before, false );
+    redo_stack.push_back( std::move( edit ) );
 }
 
-void LobbyManager::JoinLobby(uint64 SteamID) {
-    SteamAPICall_t hSteamAPICall = SteamMatchmaking()->JoinLobby(SteamID);
-    m_LobbyJoinCallResult.Set( hSteamAPICall, this, &LobbyManager::OnLobbyJoin );
+void ChatInput::Redo() {
+    if ( redo_stack.empty() ) return;
+    Edit edit = std::move( redo_stack.back() );
+    redo_stack.pop_back();
+
+    if ( !edit.removed.empty() ) ApplyErase( edit.pos, edit.removed.size() );
+    if ( !edit.inserted.empty() ) ApplyInsert( edit.pos, edit.inserted.data(), edit.inserted.size() );
+    MoveCursor( edit.cursor_after, false );
+    undo_stack.push_back( std::move( edit ) );
 }
 
-void LobbyManager::reFillMembersVector() {
-    lobby_manager.members.clear();
-    int nMembers = SteamMatchmaking()->GetNumLobbyMembers( lobby_manager.id );
-    for (int i = 0; i < nMembers; i++) {
-        lobby_manager.members.push_back( SteamMatchmaking()->GetLobbyMemberByIndex( lobby_manager.id, i ).ConvertToUint64() );
-    }
+size_t ChatInput::PrevCodepoint( size_t pos ) const {
+    if ( pos == 0 ) return 0;
+    pos--;
+    while ( pos > 0 && (buffer.At( pos ) & 0xC0) == 0x80 ) pos--;
+    return pos;
 }
 
-void LobbyManager::OnLobbyJoin( LobbyEnter_t *pCallback, bool bIOFailure ) {
-    if ( bIOFailure || pCallback->m_EChatRoomEnterResponse == k_EChatRoomEnterResponseError ) {
-        TraceLog(LOG_ERROR, "Couldn't Join Lobby");
-        screen_state = eScreenState::OUTSIDE_LOBBY;
+size_t ChatInput::NextCodepoint( size_t pos ) const {
+    if ( pos >= buffer.Size() ) return buffer.Size();
+    pos++;
+    while ( pos < buffer.Size() && (buffer.At( pos ) & 0xC0) == 0x80 ) pos++;
+    return pos;
+}
+
+void ChatInput::MoveCursor( size_t pos, bool select ) {
+    cursor = pos;
+    if ( !select ) anchor = pos;
+    Locate( pos );
+}
+
+void ChatInput::MoveVertical( int lines, bool select ) {
+    Location at = Locate( cursor );
+    if ( (lines < 0 && at.line == 0) || (lines > 0 && at.line + 1 >= line_lengths.size()) ) {
+        MoveCursor( lines < 0 ? 0 : buffer.Size(), select );
         return;
     }
+    size_t line = at.line + lines;
+    size_t start = LineStart( line );
+    size_t pos = start + MIN( at.column, static_cast<size_t>( line_lengths[line] ) );
+    while ( pos > start && pos < buffer.Size() && (buffer.At( pos ) & 0xC0) == 0x80 ) pos--;
+    MoveCursor( pos, select );
+}
 
-    lobby_manager.id = pCallback->m_ulSteamIDLobby;
-    lobby_manager.lobby_leader = SteamMatchmaking()->GetLobbyData( lobby_manager.id, "lobby_leader" );
-    strncpy( lobby_manager.lobby_name, SteamMatchmaking()->GetLobbyData( lobby_manager.id, "lobby_leader" ), 100 );
+static bool KeyPressedOrRepeat( int key ) {
+    return IsKeyPressed( key ) || IsKeyPressedRepeat( key );
+}
 
-    reFillMembersVector();
-    messages.clear();
+void ChatInput::HandleKeys() {
+    bool ctrl = IsKeyDown( KEY_LEFT_CONTROL ) || IsKeyDown( KEY_RIGHT_CONTROL );
+    bool shift = IsKeyDown( KEY_LEFT_SHIFT ) || IsKeyDown( KEY_RIGHT_SHIFT );
+    size_t sel_begin = MIN( cursor, anchor );
+    size_t sel_end = cursor > anchor ? cursor : anchor;
 
-    TraceLog(LOG_INFO, "Joined Lobby %lld", lobby_manager.id);
-    SendMessage("SERVER", TextFormat("%s has Joined the lobby", SteamFriends()->GetPersonaName()));
-    screen_state = eScreenState::LOBBY;
+    // Typed characters, encoded back to UTF-8
+    int codepoint;
+    while ( (codepoint = GetCharPressed()) > 0 ) {
+        char utf8[4];
+        int len = 0;
+        if ( codepoint < 0x80 ) { utf8[len++] = codepoint; }
+        else if ( codepoint < 0x800 ) { utf8[len++] = 0xC0 | (codepoint >> 6); utf8[len++] = 0x80 | (codepoint & 0x3F); }
+        else if ( codepoint < 0x10000 ) { utf8[len++] = 0xE0 | (codepoint >> 12); utf8[len++] = 0x80 | ((codepoint >> 6) & 0x3F); utf8[len++] = 0x80 | (codepoint & 0x3F); }
+        else { utf8[len++] = 0xF0 | (codepoint >> 18); utf8[len++] = 0x80 | ((codepoint >> 12) & 0x3F); utf8[len++] = 0x80 | ((codepoint >> 6) & 0x3F); utf8[len++] = 0x80 | (codepoint & 0x3F); }
+        Replace( sel_begin, sel_end, utf8, len, true );
+        sel_begin = sel_end = cursor;
+    }
+
+    if ( ctrl && IsKeyPressed( KEY_A ) ) {
+        anchor = 0;
+        MoveCursor( buffer.Size(), true );
+    } else if ( ctrl && (IsKeyPressed( KEY_C ) || IsKeyPressed( KEY_X )) && sel_end > sel_begin ) {
+        SetClipboardText( buffer.Substr( sel_begin, sel_end - sel_begin ).c_str() );
+        if ( IsKeyPressed( KEY_X ) ) Replace( sel_begin, sel_end, "", 0, false );
+    } else if ( ctrl && KeyPressedOrRepeat( KEY_V ) ) {
+        const char* clipboard = GetClipboardText();
+        if ( clipboard != NULL ) Replace( sel_begin, sel_end, clipboard, strlen( clipboard ), false );
+    } else if ( ctrl && KeyPressedOrRepeat( KEY_Z ) ) {
+        shift ? Redo() : Undo();
+    } else if ( ctrl && KeyPressedOrRepeat( KEY_Y ) ) {
+        Redo();
+    } else if ( KeyPressedOrRepeat( KEY_BACKSPACE ) ) {
+        if ( sel_end > sel_begin ) Replace( sel_begin, sel_end, "", 0, false );
+        else if ( cursor > 0 ) Replace( PrevCodepoint( cursor ), cursor, "", 0, false );
+    } else if ( KeyPressedOrRepeat( KEY_DELETE ) ) {
+        if ( sel_end > sel_begin ) Replace( sel_begin, sel_end, "", 0, false );
+        else if ( cursor < buffer.Size() ) Replace( cursor, NextCodepoint( cursor ), "", 0, false );
+    } else if ( shift && KeyPressedOrRepeat( KEY_ENTER ) ) {
+        Replace( sel_begin, sel_end, "\n", 1, false );
+    } else if ( KeyPressedOrRepeat( KEY_LEFT ) ) {
+        MoveCursor( !shift && sel_end > sel_begin ? sel_begin : PrevCodepoint( cursor ), shift );
+    } else if ( KeyPressedOrRepeat( KEY_RIGHT ) ) {
+        MoveCursor( !shift && sel_end > sel_begin ? sel_end : NextCodepoint( cursor ), shift );
+    } else if ( KeyPressedOrRepeat( KEY_UP ) ) {
+        MoveVertical( -1, shift );
+    } else if ( KeyPressedOrRepeat( KEY_DOWN ) ) {
+        MoveVertical( 1, shift );
+    } else if ( IsKeyPressed( KEY_HOME ) ) {
+        Location at = Locate( cursor );
+        MoveCursor( ctrl ? 0 : cursor - at.column, shift );
+    } else if ( IsKeyPressed( KEY_END ) ) {
+        Location at = Locate( cursor );
+        MoveCursor( ctrl ? buffer.Size() : cursor - at.column + line_lengths[at.line], shift );
+    }
 }
 
-void LobbyManager::LeaveLobby() {
-    if (id == 0) {
-        TraceLog(LOG_WARNING, "Not Connected to Any Lobby");
-        return;
+bool ChatInput::Update( Rectangle bounds, float font_size ) {
+    if ( IsMouseButtonPressed( MOUSE_BUTTON_LEFT ) && CheckCollisionPointRec( GetMousePosition(), bounds ) ) {
+        focused = true;
     }
-    SteamMatchmaking()->LeaveLobby( this->id );
-    this->id = 0;
-    this->lobby_leader.clear();
-    this->members.clear();
-    SendMessage("SERVER", TextFormat("%s has Left the lobby", SteamFriends()->GetPersonaName()));
+
+    bool send = false;
+    if ( focused ) {
+        bool shift = IsKeyDown( KEY_LEFT_SHIFT ) || IsKeyDown( KEY_RIGHT_SHIFT );
+        send = IsKeyPressed( KEY_ENTER ) && !shift;
+        if ( !send ) {
+            HandleKeys();
+        }
+    }
+
+    Draw( bounds, font_size );
+    return send;
 }
 
-// Call Backs
+void ChatInput::Draw( Rectangle bounds, float font_size ) {
+    float line_height = font_size + 4;
+    size_t visible_lines = static_cast<size_t>( (bounds.height - 20) / line_height );
+    visible_lines = visible_lines > 0 ? visible_lines : 1;
+    float text_width = bounds.width - 20;
 
-void LobbyManager::OnLobbyDataUpdate( LobbyChatUpdate_t *pCallback ) {
-    uint64 lobby_id = pCallback->m_ulSteamIDLobby;
-    uint64 member_id = pCallback->m_ulSteamIDUserChanged;
+    // Keep the cursor on screen, vertically by line and horizontally by bytes
+    Location at = Locate( cursor );
+    if ( at.line < scroll_line ) scroll_line = at.line;
+    if ( at.line >= scroll_line + visible_lines ) scroll_line = at.line - visible_lines + 1;
+    size_t visible_bytes = static_cast<size_t>( text_width / (font_size * 0.5f) );
+    if ( at.column < scroll_column ) scroll_column = at.column;
+    if ( at.column > scroll_column + visible_bytes ) scroll_column = at.column - visible_bytes;
 
-    reFillMembersVector();
+    DrawRectangleRec( bounds, WHITE );
+    DrawRectangleLinesEx( bounds, 1, focused ? BLUE : GRAY );
+    BeginScissorMode( bounds.x, bounds.y, bounds.width, bounds.height );
 
-    switch (pCallback->m_rgfChatMemberStateChange) {
-        case k_EChatMemberStateChangeEntered:
-            break;
-        case k_EChatMemberStateChangeLeft:
-            break;
+    size_t sel_begin = MIN( cursor, anchor );
+    size_t sel_end = cursor > anchor ? cursor : anchor;
+    size_t line_start = LineStart( scroll_line );
+    size_t last_line = MIN( scroll_line + visible_lines, line_lengths.size() );
+    for ( size_t line = scroll_line; line < last_line; line++ ) {
+        float y = bounds.y + 10 + (line - scroll_line) * line_height;
+        size_t len = line_lengths[line];
+
+        // Only the slice of the line that can be on screen gets copied and drawn
+        size_t from = line_start + MIN( scroll_column, len );
+        while ( from > line_start && (buffer.At( from ) & 0xC0) == 0x80 ) from--;
+        size_t to = MIN( line_start + len, from + CHAT_INPUT_MAX_DRAWN_BYTES );
+        std::string text = buffer.Substr( from, to - from );
+
+        auto x_of = [&]( size_t pos ) {
+            size_t clamped = pos < from ? from : (pos > to ? to : pos);
+            return bounds.x + 10 + text_renderer.Measure( text.data(), clamped - from, font_size );
+        };
+
+        if ( sel_end > sel_begin && sel_begin <= line_start + len && sel_end >= line_start ) {
+            float x0 = x_of( sel_begin ), x1 = x_of( sel_end );
+            if ( sel_end > line_start + len ) x1 += font_size * 0.3f; // selected newline
+            DrawRectangleRec( Rectangle { x0, y - 2, x1 - x0, line_height }, SKYBLUE );
+        }
+
+        text_renderer.Queue( text.c_str(), text.size(), Vector2 { bounds.x + 10, y }, font_size, BLACK );
+
+        if ( focused && line == at.line && fmod( GetTime(), 1.0 ) < 0.6 ) {
+            float x = x_of( cursor );
+            DrawLine( x, y - 2, x, y + font_size + 2, BLACK );
+        }
+
+        line_start += len + 1;
     }
+
+    text_renderer.Flush();
+    EndScissorMode();
 }
 
-void LobbyManager::OnLobbyMessageRecieved( LobbyChatMsg_t *pCallback ) {
-    if ( pCallback->m_eChatEntryType == 0 ) {
-        TraceLog(LOG_ERROR, "Invalid Message recieved");
-        return;
+// Multipart Implementation
+
+bool MessageReassembler::IsPart( const char* data, int size ) {
+    return size >= MULTIPART_HEADER_SIZE && memcmp( data, MULTIPART_MAGIC, 3 ) == 0;
+}
+
+void MessageReassembler::Drop( std::map<std::pair<uint64, uint32>, Pending>::iterator it ) {
+    pending_bytes -= it->second.bytes;
+    pending.erase( it );
+}
+
+bool MessageReassembler::Add( uint64 sender, const char* data, int size, std::string& out ) {
+    const uint8* header = reinterpret_cast<const uint8*>( data );
+    uint32 message_id = header[3] | (header[4] << 8) | (header[5] << 16) | (static_cast<uint32>( header[6] ) << 24);
+    uint16 part = header[7] | (header[8] << 8);
+    uint16 count = header[9] | (header[10] << 8);
+    size_t len = size - MULTIPART_HEADER_SIZE;
+
+    if ( count == 0 || count > MULTIPART_MAX_PARTS || part >= count ) {
+        TraceLog( LOG_WARNING, "Dropping malformed message part %d / %d", part, count );
+        return false;
     }
 
-    uint32 chatID = pCallback->m_iChatID;
-    uint64 lobbyID = pCallback->m_ulSteamIDLobby;
-    CSteamID sender = pCallback->m_ulSteamIDUser;
+    // Make room, oldest incomplete messages go first
+    while ( pending_bytes + len > MULTIPART_MAX_PENDING_BYTES && !pending.empty() ) {
+        auto oldest = pending.begin();
+        for ( auto it = pending.begin(); it != pending.end(); ++it ) {
+            if ( it->second.first_seen < oldest->second.first_seen ) oldest = it;
+        }
+        TraceLog( LOG_WARNING, "Reassembly buffer full, dropping an incomplete message" );
+        Drop( oldest );
+    }
 
-    char recievedMsg[MAX_CHATMSG_SIZE];
-    int end = SteamMatchmaking()->GetLobbyChatEntry( lobbyID, chatID, &sender, recievedMsg, MAX_CHATMSG_SIZE, NULL);
-    recievedMsg[end] = '\0';
+    Pending& message = pending[{ sender, message_id }];
+    if ( message.parts.empty() ) {
+        message.parts.resize( count );
+        message.arrived.resize( count );
+        message.first_seen = Tracer::Now() / 1e6;
+    }
+    if ( message.parts.size() != count || message.arrived[part] ) {
+        return false; // duplicate part, or a part count that doesn't match the first one
+    }
+
+    message.parts[part].assign( data + MULTIPART_HEADER_SIZE, len );
+    message.arrived[part] = true;
+    message.received++;
+    message.bytes += len;
+    pending_bytes += len;
+
+    if ( message.received < count ) {
+        return false;
+    }
+
+    out.clear();
+    out.reserve( message.bytes );
+    for ( const std::string& p : message.parts ) {
+        out += p;
+    }
+    Drop( pending.find( { sender, message_id } ) );
+    return true;
+}
+
+void MessageReassembler::Expire() {
+    if ( pending.empty() ) {
+        return;
+    }
+    double now = Tracer::Now() / 1e6;
+    for ( auto it = pending.begin(); it != pending.end(); ) {
+        auto next = std::next( it );
+        if ( now - it->second.first_seen > MULTIPART_TIMEOUT ) {
+            TraceLog( LOG_WARNING, "Gave up on a message, %d of %zu parts arrived", it->second.received, it->second.parts.size() );
+            Drop( it );
+        }
+        it = next;
+    }
+}
 
-    messages.push_back(recievedMsg);
+void MessageReassembler::Clear() {
+    pending.clear();
+    pending_bytes = 0;
 }